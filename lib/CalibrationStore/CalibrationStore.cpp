@@ -0,0 +1,227 @@
+/*
+This is the CalibrationStore library, which saves and loads an oMIDItone
+head's startup test results in the EEPROM.
+
+Copyright 2019 - kiyoshigawa - tim@twa.ninja
+*/
+/*
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <CalibrationStore.h>
+
+CalibrationStore::CalibrationStore()
+{
+	slot_number = CS_NO_SLOT;
+	id = 0;
+}
+
+/* ----- PUBLIC FUNCTIONS BELOW ----- */
+
+void CalibrationStore::begin(uint8_t slot, uint8_t head_id)
+{
+	if(slot >= CS_MAX_SLOTS){
+		slot = CS_NO_SLOT;
+	}
+	slot_number = slot;
+	id = head_id;
+}
+
+bool CalibrationStore::has_slot(void)
+{
+	return slot_number != CS_NO_SLOT;
+}
+
+bool CalibrationStore::save(const uint32_t * freqs, uint16_t num_steps, uint32_t smallest, uint32_t largest)
+{
+	if(!has_slot() || num_steps < 2 || CS_ENCODED_SIZE(num_steps) > CS_SLOT_SIZE){
+		return false;
+	}
+	uint8_t buffer[CS_SLOT_SIZE];
+	for(int i=0; i<CS_SLOT_SIZE; i++){
+		buffer[i] = 0;
+	}
+	uint16_t size = CS_ENCODED_SIZE(num_steps);
+
+	buffer[0] = CS_FORMAT_VERSION;
+	buffer[1] = id;
+	buffer[2] = num_steps & 0xFF;
+	buffer[3] = num_steps >> 8;
+	put_32(buffer, 4, freqs[0]);
+	put_32(buffer, 8, smallest);
+	put_32(buffer, 12, largest);
+
+	//this is the step before as load() will see it, which every step is stored relative to:
+	uint32_t previous = freqs[0];
+	uint8_t * block = &buffer[CS_HEADER_SIZE];
+	for(uint16_t first=1; first<num_steps; first+=CS_BLOCK_STEPS){
+		uint16_t last = first + CS_BLOCK_STEPS;
+		if(last > num_steps){
+			last = num_steps;
+		}
+		//find the biggest step in the block, as a fraction of the step before it in 1/65536ths:
+		uint32_t biggest = 0;
+		for(uint16_t i=first; i<last; i++){
+			if(freqs[i] < freqs[i-1]){
+				uint32_t fraction = ((uint64_t)(freqs[i-1] - freqs[i]) << 16) / freqs[i-1];
+				if(fraction > biggest){
+					biggest = fraction;
+				}
+			}
+		}
+		//use the smallest unit that can still reach the biggest step in CS_MAX_COUNT counts:
+		uint32_t full_unit = CS_MAX_COUNT << CS_UNIT_SHIFT;
+		uint32_t unit = (biggest + full_unit - 1) / full_unit;
+		if(unit < 1){
+			unit = 1;
+		} else if(unit > 255){
+			unit = 255;
+		}
+		block[0] = unit;
+
+		for(uint16_t i=first; i<last; i++){
+			uint8_t count = 0;
+			if(freqs[i] < previous){
+				uint32_t fraction = ((uint64_t)(previous - freqs[i]) << 16) / previous;
+				uint32_t unit_fraction = unit << CS_UNIT_SHIFT;
+				uint32_t rounded = (fraction + unit_fraction/2) / unit_fraction;
+				if(rounded > CS_MAX_COUNT){
+					rounded = CS_MAX_COUNT;
+				}
+				count = rounded;
+			}
+			put_count(&block[1], i - first, count);
+			previous = apply_count(previous, unit, count);
+		}
+		block += CS_BLOCK_SIZE;
+	}
+
+	uint16_t crc = crc16(buffer, size - CS_CRC_SIZE);
+	buffer[size-2] = crc & 0xFF;
+	buffer[size-1] = crc >> 8;
+
+	//update() skips bytes that are already the same, which saves wear on the EEPROM when the table hasn't changed much:
+	uint16_t base = slot_number * CS_SLOT_SIZE;
+	for(uint16_t i=0; i<size; i++){
+		EEPROM.update(base + i, buffer[i]);
+	}
+	return true;
+}
+
+bool CalibrationStore::load(uint32_t * freqs, uint16_t num_steps, uint32_t * smallest, uint32_t * largest)
+{
+	if(!has_slot() || num_steps < 2 || CS_ENCODED_SIZE(num_steps) > CS_SLOT_SIZE){
+		return false;
+	}
+	uint8_t buffer[CS_SLOT_SIZE];
+	uint16_t size = CS_ENCODED_SIZE(num_steps);
+	uint16_t base = slot_number * CS_SLOT_SIZE;
+	for(uint16_t i=0; i<size; i++){
+		buffer[i] = EEPROM.read(base + i);
+	}
+
+	//make sure the slot is for this head and this table before trusting anything in it:
+	if(buffer[0] != CS_FORMAT_VERSION || buffer[1] != id || (buffer[2] | (buffer[3] << 8)) != num_steps){
+		return false;
+	}
+	uint16_t crc = buffer[size-2] | (buffer[size-1] << 8);
+	if(crc != crc16(buffer, size - CS_CRC_SIZE)){
+		return false;
+	}
+
+	freqs[0] = get_32(buffer, 4);
+	*smallest = get_32(buffer, 8);
+	*largest = get_32(buffer, 12);
+
+	const uint8_t * block = &buffer[CS_HEADER_SIZE];
+	for(uint16_t first=1; first<num_steps; first+=CS_BLOCK_STEPS){
+		uint16_t last = first + CS_BLOCK_STEPS;
+		if(last > num_steps){
+			last = num_steps;
+		}
+		for(uint16_t i=first; i<last; i++){
+			freqs[i] = apply_count(freqs[i-1], block[0], get_count(&block[1], i - first));
+		}
+		block += CS_BLOCK_SIZE;
+	}
+	return true;
+}
+
+/* ----- END PUBLIC FUNCTIONS ----- */
+/* ----- PRIVATE FUNCTIONS BELOW ----- */
+
+uint16_t CalibrationStore::crc16(const uint8_t * data, uint16_t length)
+{
+	uint16_t crc = 0xFFFF;
+	for(uint16_t i=0; i<length; i++){
+		crc ^= (uint16_t)data[i] << 8;
+		for(uint8_t bit=0; bit<8; bit++){
+			if(crc & 0x8000){
+				crc = (crc << 1) ^ 0x1021;
+			} else {
+				crc = crc << 1;
+			}
+		}
+	}
+	return crc;
+}
+
+void CalibrationStore::put_32(uint8_t * buffer, uint16_t position, uint32_t value)
+{
+	for(uint8_t i=0; i<4; i++){
+		buffer[position+i] = (value >> (8*i)) & 0xFF;
+	}
+}
+
+uint32_t CalibrationStore::get_32(const uint8_t * buffer, uint16_t position)
+{
+	uint32_t value = 0;
+	for(uint8_t i=0; i<4; i++){
+		value |= (uint32_t)buffer[position+i] << (8*i);
+	}
+	return value;
+}
+
+void CalibrationStore::put_count(uint8_t * block, uint8_t index, uint8_t count)
+{
+	//the counts are packed low bit first, and can run over into the next byte:
+	uint16_t bit = index * CS_COUNT_BITS;
+	for(uint8_t i=0; i<CS_COUNT_BITS; i++, bit++){
+		if(count & (1 << i)){
+			block[bit/8] |= 1 << (bit%8);
+		} else {
+			block[bit/8] &= ~(1 << (bit%8));
+		}
+	}
+}
+
+uint8_t CalibrationStore::get_count(const uint8_t * block, uint8_t index)
+{
+	uint8_t count = 0;
+	uint16_t bit = index * CS_COUNT_BITS;
+	for(uint8_t i=0; i<CS_COUNT_BITS; i++, bit++){
+		if(block[bit/8] & (1 << (bit%8))){
+			count |= 1 << i;
+		}
+	}
+	return count;
+}
+
+uint32_t CalibrationStore::apply_count(uint32_t previous, uint8_t unit, uint8_t count)
+{
+	uint32_t change = ((uint64_t)previous * count * ((uint32_t)unit << CS_UNIT_SHIFT)) >> 16;
+	return previous - change;
+}
+
+/* ----- END PRIVATE FUNCTIONS ----- */
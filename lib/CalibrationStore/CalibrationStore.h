@@ -0,0 +1,125 @@
+/*
+This keeps an oMIDItone head's startup test results in the Teensy's EEPROM, so
+they don't have to be measured all over again every time the controller is
+powered on.
+
+Each head gets its own slot of CS_SLOT_SIZE bytes. The Teensy 3.2 only has
+2KB of EEPROM, which is about 340 bytes for each of six heads, and a table of
+768 32 bit inverted frequencies would need 3KB for just one. The table is
+always in order (each step is a little less than the one before it), so
+instead of the values, the slot holds how much each step goes down by, as a
+fraction of the step before it.
+
+The steps are stored in blocks of CS_BLOCK_STEPS. Each block starts with a
+unit byte, and then each step in the block is a 3 bit count of units from 0 to
+7. The unit is picked for each block from the biggest step in it, so the
+steep parts of the table and the flat parts both get units that suit them.
+
+The encoder works out every step from the value the decoder will have for the
+step before it, rather than the true value, so the rounding errors don't add
+up along the table. Every stored step is within half a unit of what was
+measured.
+
+The slot also keeps a format version, an id for the head it belongs to, and a
+CRC16 of everything else. If any of them don't match, load() returns false and
+the head is tested the slow way instead.
+
+Copyright 2019 - kiyoshigawa - tim@twa.ninja
+*/
+
+/*
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CALIBRATION_STORE_H
+#define CALIBRATION_STORE_H
+
+#include <Arduino.h>
+#include <EEPROM.h>
+
+//Change this whenever the layout of a slot changes, so old slots are ignored instead of being read wrong.
+#define CS_FORMAT_VERSION 1
+
+//This is the size of each head's slot in the EEPROM. Six of them fit in the Teensy 3.2's 2KB.
+#define CS_SLOT_SIZE 340
+
+//This is the number of slots that fit in the EEPROM.
+#define CS_MAX_SLOTS ((E2END+1)/CS_SLOT_SIZE)
+
+//This is the slot number for a store that hasn't been given one. Nothing is loaded or saved for it.
+#define CS_NO_SLOT 255
+
+//This is the number of steps that share a unit.
+#define CS_BLOCK_STEPS 32
+
+//This is the size of the count for each step, in bits. The largest count is CS_MAX_COUNT.
+#define CS_COUNT_BITS 3
+#define CS_MAX_COUNT ((1<<CS_COUNT_BITS)-1)
+
+//The units are stored in 1/2^(16-CS_UNIT_SHIFT) of the step before, so a unit byte of 255 allows a step of about 11%.
+#define CS_UNIT_SHIFT 2
+
+//This is the size of the version, head id, step count, first step and range at the start of a slot.
+#define CS_HEADER_SIZE 16
+
+//This is the size of one block: the unit byte and the packed counts.
+#define CS_BLOCK_SIZE (1 + (CS_BLOCK_STEPS*CS_COUNT_BITS+7)/8)
+
+//This is the size of the CRC at the end of a slot.
+#define CS_CRC_SIZE 2
+
+//This is the number of bytes needed to store a table with num_steps steps. It needs to be no more than CS_SLOT_SIZE.
+#define CS_ENCODED_SIZE(num_steps) (CS_HEADER_SIZE + (((num_steps)-1+CS_BLOCK_STEPS-1)/CS_BLOCK_STEPS)*CS_BLOCK_SIZE + CS_CRC_SIZE)
+
+class CalibrationStore {
+	public:
+		//constructor function
+		CalibrationStore();
+
+		//This picks the slot to use and the id of the head using it, so a slot saved by a different head isn't loaded.
+		//Slots past CS_MAX_SLOTS are ignored, the same as CS_NO_SLOT.
+		void begin(uint8_t slot, uint8_t head_id);
+
+		//This returns true if the store has a slot to use.
+		bool has_slot(void);
+
+		//This will save a table of num_steps inverted frequencies, which must be in order from largest to smallest, along with the
+		//smallest and largest inverted frequencies the head can play. Only bytes that have changed are written. Returns false if it didn't fit.
+		bool save(const uint32_t * freqs, uint16_t num_steps, uint32_t smallest, uint32_t largest);
+
+		//This will load a table saved by save() into freqs, and returns true if it was there and undamaged.
+		//If it returns false, freqs, smallest and largest may have been partly overwritten.
+		bool load(uint32_t * freqs, uint16_t num_steps, uint32_t * smallest, uint32_t * largest);
+
+	private:
+		//This returns the CRC16-CCITT of length bytes of data.
+		static uint16_t crc16(const uint8_t * data, uint16_t length);
+
+		//These put and get a 32 bit value at a position in a buffer, low byte first.
+		static void put_32(uint8_t * buffer, uint16_t position, uint32_t value);
+		static uint32_t get_32(const uint8_t * buffer, uint16_t position);
+
+		//These put and get the count for a step in the packed part of a block.
+		static void put_count(uint8_t * block, uint8_t index, uint8_t count);
+		static uint8_t get_count(const uint8_t * block, uint8_t index);
+
+		//This works out a step from the step before it and its count, the same way for both save() and load().
+		static uint32_t apply_count(uint32_t previous, uint8_t unit, uint8_t count);
+
+		//this is the slot and head id set by begin()
+		uint8_t slot_number;
+		uint8_t id;
+};
+
+#endif
@@ -0,0 +1,450 @@
+/*
+This is the FeedbackSampler library, which owns both ADCs on the Teensy 3.2 and
+shares them between the oMIDItone feedback pins, either by polling two pins at
+once or by using the PDB timer and DMA to sample them in the background.
+
+Copyright 2019 - kiyoshigawa - tim@twa.ninja
+*/
+/*
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <FeedbackSampler.h>
+
+FeedbackSampler * FeedbackSampler::active_sampler = NULL;
+
+FeedbackSampler::FeedbackSampler()
+{
+	num_pins = 0;
+	for(int i=0; i<FS_MAX_PINS; i++){
+		pins[i] = 0;
+		slot_adc[i] = 0;
+		slot_position[i] = 0;
+		samples_queued[i] = 0;
+		samples_read[i] = 0;
+		samples_ready[i] = 0;
+		samples_overrun[i] = 0;
+	}
+	for(int a=0; a<FS_NUM_ADCS; a++){
+		adc_num_pins[a] = 0;
+		next_poll_position[a] = 0;
+		result_buffer_wraps[a] = 0;
+		for(int i=0; i<FS_MAX_PINS; i++){
+			adc_slots[a][i] = 0;
+			channel_list[a][i] = FS_INVALID_CHANNEL;
+		}
+	}
+	sampling_mode = FS_MODE_DMA;
+	running = false;
+	adc = new ADC();
+}
+
+/* ----- PUBLIC FUNCTIONS BELOW ----- */
+
+uint8_t FeedbackSampler::add_pin(uint8_t pin)
+{
+	//if the pin is already being sampled, hand back the same slot:
+	for(uint8_t slot=0; slot<num_pins; slot++){
+		if(pins[slot] == pin){
+			return slot;
+		}
+	}
+	if(num_pins >= FS_MAX_PINS){
+		return FS_NO_SLOT;
+	}
+	if(pin_to_channel(0, pin) == FS_INVALID_CHANNEL && pin_to_channel(1, pin) == FS_INVALID_CHANNEL){
+		return FS_NO_SLOT;
+	}
+	uint8_t slot = num_pins;
+	pins[slot] = pin;
+	num_pins++;
+
+	//the ADC assignments and the interleaving in the buffers are different now, so sampling needs a restart:
+	if(running){
+		end();
+		begin(sampling_mode);
+	} else {
+		assign_pins_to_adcs();
+	}
+	return slot;
+}
+
+void FeedbackSampler::begin(uint8_t mode)
+{
+	if(running || num_pins == 0){
+		return;
+	}
+	sampling_mode = mode;
+	assign_pins_to_adcs();
+
+	//make sure the cycle counter is running, since all the timestamps are based on it:
+	ARM_DEMCR |= ARM_DEMCR_TRCENA;
+	ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+
+	//everyone starts over with an empty buffer:
+	for(uint8_t slot=0; slot<num_pins; slot++){
+		samples_queued[slot] = 0;
+		samples_read[slot] = 0;
+		samples_ready[slot] = 0;
+	}
+
+	//set up both ADCs for fast 8-bit readings:
+	adc->adc0->setAveraging(0);
+	adc->adc0->setResolution(FS_ADC_RESOLUTION);
+	adc->adc0->setConversionSpeed(ADC_CONVERSION_SPEED::HIGH_SPEED);
+	adc->adc0->setSamplingSpeed(ADC_SAMPLING_SPEED::VERY_HIGH_SPEED);
+	adc->adc1->setAveraging(0);
+	adc->adc1->setResolution(FS_ADC_RESOLUTION);
+	adc->adc1->setConversionSpeed(ADC_CONVERSION_SPEED::HIGH_SPEED);
+	adc->adc1->setSamplingSpeed(ADC_SAMPLING_SPEED::VERY_HIGH_SPEED);
+
+	if(sampling_mode == FS_MODE_DMA){
+		begin_dma();
+	}
+
+	running = true;
+}
+
+void FeedbackSampler::end(void)
+{
+	if(!running){
+		return;
+	}
+	if(sampling_mode == FS_MODE_DMA){
+		PDB0_SC = 0;
+		for(int a=0; a<FS_NUM_ADCS; a++){
+			mux_dma[a].disable();
+			result_dma[a].disable();
+		}
+		ADC0_SC2 &= ~(ADC_SC2_ADTRG | ADC_SC2_DMAEN);
+		ADC1_SC2 &= ~(ADC_SC2_ADTRG | ADC_SC2_DMAEN);
+	}
+	running = false;
+}
+
+bool FeedbackSampler::is_running(void)
+{
+	return running;
+}
+
+void FeedbackSampler::poll(uint8_t slot)
+{
+	if(!running || slot >= num_pins){
+		return;
+	}
+
+	if(sampling_mode == FS_MODE_DMA){
+		//look at the DMA position once for the whole pass of reads, rather than once per sample:
+		samples_ready[slot] = samples_written(slot);
+		uint32_t unread = samples_ready[slot] - samples_read[slot];
+		//if the DMA has lapped this slot, skip ahead to the oldest sample that is safe to read:
+		if(unread > FS_BUFFER_SAMPLES - FS_OVERRUN_MARGIN){
+			uint32_t skipped = unread - (FS_BUFFER_SAMPLES - FS_OVERRUN_MARGIN);
+			samples_read[slot] += skipped;
+			samples_overrun[slot] += skipped;
+		}
+		return;
+	}
+	uint8_t this_adc = slot_adc[slot];
+	uint8_t other_adc = 1 - this_adc;
+
+	//if the other ADC has nothing to do, just read this one pin:
+	if(adc_num_pins[other_adc] == 0){
+		uint32_t now = ARM_DWT_CYCCNT;
+		if(this_adc == 0){
+			push_polled_sample(slot, adc->adc0->analogRead(pins[slot]), now);
+		} else {
+			push_polled_sample(slot, adc->adc1->analogRead(pins[slot]), now);
+		}
+		return;
+	}
+
+	//otherwise read the next pin in line on the other ADC at the same time:
+	uint8_t partner = adc_slots[other_adc][next_poll_position[other_adc]];
+	next_poll_position[other_adc] = (next_poll_position[other_adc] + 1) % adc_num_pins[other_adc];
+	uint8_t adc0_slot = (this_adc == 0) ? slot : partner;
+	uint8_t adc1_slot = (this_adc == 0) ? partner : slot;
+	uint32_t now = ARM_DWT_CYCCNT;
+	ADC::Sync_result result = adc->analogSynchronizedRead(pins[adc0_slot], pins[adc1_slot]);
+	push_polled_sample(adc0_slot, result.result_adc0, now);
+	push_polled_sample(adc1_slot, result.result_adc1, now);
+}
+
+bool FeedbackSampler::read_sample(uint8_t slot, uint8_t * value, uint32_t * timestamp)
+{
+	if(!running || slot >= num_pins){
+		return false;
+	}
+
+	if(sampling_mode == FS_MODE_POLLED){
+		if(samples_read[slot] == samples_queued[slot]){
+			return false;
+		}
+		uint32_t index = samples_read[slot] & (FS_POLL_QUEUE_SAMPLES-1);
+		*value = poll_queue[slot][index];
+		*timestamp = poll_queue_times[slot][index];
+		samples_read[slot]++;
+		return true;
+	}
+
+	//poll() has already made sure everything up to samples_ready is safe to read:
+	if(samples_read[slot] == samples_ready[slot]){
+		return false;
+	}
+	uint8_t adc_num = slot_adc[slot];
+	uint8_t n = adc_num_pins[adc_num];
+	uint8_t position = slot_position[slot];
+	uint32_t sample_number = samples_read[slot];
+	*value = result_buffer[adc_num][(sample_number & (FS_BUFFER_SAMPLES-1))*n + position];
+	*timestamp = (sample_number*n + position)*FS_TRIGGER_PERIOD;
+	samples_read[slot]++;
+	return true;
+}
+
+uint32_t FeedbackSampler::current_time(void)
+{
+	if(sampling_mode == FS_MODE_POLLED){
+		return ARM_DWT_CYCCNT;
+	}
+	//both ADCs are triggered together, so either one that is running will do:
+	uint8_t adc_num = (adc_num_pins[0] > 0) ? 0 : 1;
+	uint32_t wraps;
+	uint32_t position;
+	dma_position(adc_num, &wraps, &position);
+	return (wraps*adc_num_pins[adc_num]*FS_BUFFER_SAMPLES + position)*FS_TRIGGER_PERIOD;
+}
+
+uint32_t FeedbackSampler::overrun_count(uint8_t slot)
+{
+	if(slot >= num_pins){
+		return 0;
+	}
+	return samples_overrun[slot];
+}
+
+uint32_t FeedbackSampler::sample_period(uint8_t slot)
+{
+	if(slot >= num_pins || sampling_mode != FS_MODE_DMA){
+		return 0;
+	}
+	//each PDB trigger converts the next pin on the ADC, so a slot comes around once every pin on its ADC:
+	return adc_num_pins[slot_adc[slot]]*FS_TRIGGER_PERIOD;
+}
+
+/* ----- END PUBLIC FUNCTIONS ----- */
+/* ----- PRIVATE FUNCTIONS BELOW ----- */
+
+uint8_t FeedbackSampler::pin_to_channel(uint8_t adc_num, uint8_t pin)
+{
+	//These are the Teensy 3.2 ADC channel maps from the schematic. Muxed channels on ADC0 are all on the b side.
+	if(adc_num == 0){
+		switch(pin){
+			case A0: return 5;
+			case A1: return 14;
+			case A2: return 8;
+			case A3: return 9;
+			case A4: return 13;
+			case A5: return 12;
+			case A6: return 6;
+			case A7: return 7;
+			case A8: return 15;
+			case A9: return 4;
+			case A10: return 0;
+			case A11: return 19;
+			case A12: return 3;
+			case A13: return 21;
+			case A14: return 23;
+			default: return FS_INVALID_CHANNEL;
+		}
+	} else {
+		switch(pin){
+			case A2: return 8;
+			case A3: return 9;
+			case A10: return 3;
+			case A12: return 0;
+			case A13: return 19;
+			default: return FS_INVALID_CHANNEL;
+		}
+	}
+}
+
+void FeedbackSampler::assign_pins_to_adcs(void)
+{
+	adc_num_pins[0] = 0;
+	adc_num_pins[1] = 0;
+
+	//first put any pin that only one ADC can read on that ADC:
+	bool assigned[FS_MAX_PINS];
+	for(uint8_t slot=0; slot<num_pins; slot++){
+		assigned[slot] = false;
+		for(uint8_t a=0; a<FS_NUM_ADCS; a++){
+			if(pin_to_channel(1-a, pins[slot]) == FS_INVALID_CHANNEL){
+				slot_adc[slot] = a;
+				assigned[slot] = true;
+			}
+		}
+	}
+	for(uint8_t slot=0; slot<num_pins; slot++){
+		if(assigned[slot]){
+			uint8_t a = slot_adc[slot];
+			slot_position[slot] = adc_num_pins[a];
+			adc_slots[a][adc_num_pins[a]] = slot;
+			adc_num_pins[a]++;
+		}
+	}
+
+	//then hand out the rest round-robin to whichever ADC has the fewest pins:
+	uint8_t next_adc = 0;
+	for(uint8_t slot=0; slot<num_pins; slot++){
+		if(!assigned[slot]){
+			uint8_t a = next_adc;
+			if(adc_num_pins[1-a] < adc_num_pins[a]){
+				a = 1-a;
+			}
+			slot_adc[slot] = a;
+			slot_position[slot] = adc_num_pins[a];
+			adc_slots[a][adc_num_pins[a]] = slot;
+			adc_num_pins[a]++;
+			next_adc = 1-a;
+		}
+	}
+
+	for(uint8_t a=0; a<FS_NUM_ADCS; a++){
+		next_poll_position[a] = 0;
+	}
+}
+
+void FeedbackSampler::begin_dma(void)
+{
+	active_sampler = this;
+
+	//each ADC's mux DMA writes the channel for its *next* conversion, so the lists are rotated by one position:
+	for(uint8_t a=0; a<FS_NUM_ADCS; a++){
+		uint8_t n = adc_num_pins[a];
+		for(uint8_t p=0; p<n; p++){
+			channel_list[a][p] = ADC_SC1_ADCH(pin_to_channel(a, pins[adc_slots[a][(p+1)%n]]));
+		}
+		result_buffer_wraps[a] = 0;
+	}
+
+	//The first ADC with pins has its mux DMA requested by the PDB, and the other one is linked to it.
+	//Only one DMA channel can be triggered by the PDB directly.
+	bool pdb_dma_assigned = false;
+	for(uint8_t a=0; a<FS_NUM_ADCS; a++){
+		uint8_t n = adc_num_pins[a];
+		if(n == 0){
+			continue;
+		}
+		volatile uint32_t * sc1a = (a == 0) ? &ADC0_SC1A : &ADC1_SC1A;
+		volatile uint32_t * result_register = (a == 0) ? &ADC0_RA : &ADC1_RA;
+
+		//conversions are started by the PDB, and the results are requested by DMA.
+		if(a == 0){
+			ADC0_SC2 |= ADC_SC2_ADTRG | ADC_SC2_DMAEN;
+			//Every ADC0 pin we use that is muxed is on the b side, so the mux can stay on b permanently.
+			ADC0_CFG2 |= ADC_CFG2_MUXSEL;
+		} else {
+			ADC1_SC2 |= ADC_SC2_ADTRG | ADC_SC2_DMAEN;
+		}
+		*sc1a = ADC_SC1_ADCH(pin_to_channel(a, pins[adc_slots[a][0]]));
+
+		//the result DMA copies the low byte of the result register into the next spot in the buffer:
+		result_dma[a].source(*(volatile uint8_t *)result_register);
+		result_dma[a].destinationBuffer(result_buffer[a], n*FS_BUFFER_SAMPLES);
+		result_dma[a].interruptAtCompletion();
+		result_dma[a].attachInterrupt((a == 0) ? adc0_result_dma_isr : adc1_result_dma_isr);
+		result_dma[a].triggerAtHardwareEvent((a == 0) ? DMAMUX_SOURCE_ADC0 : DMAMUX_SOURCE_ADC1);
+
+		//the mux DMA steps through the channel list once every PDB period:
+		mux_dma[a].sourceBuffer(channel_list[a], n*sizeof(uint32_t));
+		mux_dma[a].destination(*sc1a);
+		if(!pdb_dma_assigned){
+			mux_dma[a].triggerAtHardwareEvent(DMAMUX_SOURCE_PDB);
+			pdb_dma_assigned = true;
+		} else {
+			mux_dma[a].triggerAtTransfersOf(mux_dma[0]);
+		}
+	}
+	for(uint8_t a=0; a<FS_NUM_ADCS; a++){
+		if(adc_num_pins[a] > 0){
+			result_dma[a].enable();
+			mux_dma[a].enable();
+		}
+	}
+
+	//The PDB triggers a conversion on both ADCs at the start of every period, and requests the mux DMA halfway through it.
+	//By the halfway point the conversions are done and have been moved out of the ADCs, so changing channels is safe.
+	SIM_SCGC6 |= SIM_SCGC6_PDB;
+	PDB0_MOD = F_BUS/FS_SAMPLE_RATE - 1;
+	PDB0_IDLY = F_BUS/FS_SAMPLE_RATE/2;
+	PDB0_CH0DLY0 = 0;
+	PDB0_CH1DLY0 = 0;
+	PDB0_CH0C1 = (adc_num_pins[0] > 0) ? 0x0101 : 0;
+	PDB0_CH1C1 = (adc_num_pins[1] > 0) ? 0x0101 : 0;
+	PDB0_SC = PDB_SC_TRGSEL(15) | PDB_SC_PDBEN | PDB_SC_CONT | PDB_SC_PDBIE | PDB_SC_DMAEN | PDB_SC_LDOK;
+	PDB0_SC |= PDB_SC_SWTRIG;
+}
+
+void FeedbackSampler::dma_position(uint8_t adc_num, uint32_t * wraps, uint32_t * position)
+{
+	//only the wrap interrupt needs to be held off. This can be called from other interrupts, so it can't turn them all back on at the end.
+	uint8_t irq = IRQ_DMA_CH0 + result_dma[adc_num].channel;
+	NVIC_DISABLE_IRQ(irq);
+	*wraps = result_buffer_wraps[adc_num];
+	*position = (volatile uint8_t *)result_dma[adc_num].TCD->DADDR - result_buffer[adc_num];
+	//if the buffer wrapped but the interrupt hasn't run yet, the position needs to be read again to be sure it is after the wrap:
+	if(DMA_INT & (1 << result_dma[adc_num].channel)){
+		*wraps = *wraps + 1;
+		*position = (volatile uint8_t *)result_dma[adc_num].TCD->DADDR - result_buffer[adc_num];
+	}
+	NVIC_ENABLE_IRQ(irq);
+}
+
+uint32_t FeedbackSampler::samples_written(uint8_t slot)
+{
+	uint8_t adc_num = slot_adc[slot];
+	uint8_t n = adc_num_pins[adc_num];
+	uint32_t wraps;
+	uint32_t position;
+	dma_position(adc_num, &wraps, &position);
+	//every wrap is FS_BUFFER_SAMPLES samples for every slot, plus however many times the slot has come up in the current pass:
+	return wraps*FS_BUFFER_SAMPLES + (position + n - 1 - slot_position[slot])/n;
+}
+
+void FeedbackSampler::push_polled_sample(uint8_t slot, uint8_t value, uint32_t timestamp)
+{
+	uint32_t index = samples_queued[slot] & (FS_POLL_QUEUE_SAMPLES-1);
+	poll_queue[slot][index] = value;
+	poll_queue_times[slot][index] = timestamp;
+	samples_queued[slot]++;
+	//if the queue was already full, the oldest reading was just overwritten:
+	if(samples_queued[slot] - samples_read[slot] > FS_POLL_QUEUE_SAMPLES){
+		samples_read[slot]++;
+		samples_overrun[slot]++;
+	}
+}
+
+void FeedbackSampler::adc0_result_dma_isr(void)
+{
+	active_sampler->result_dma[0].clearInterrupt();
+	active_sampler->result_buffer_wraps[0]++;
+}
+
+void FeedbackSampler::adc1_result_dma_isr(void)
+{
+	active_sampler->result_dma[1].clearInterrupt();
+	active_sampler->result_buffer_wraps[1]++;
+}
+
+/* ----- END PRIVATE FUNCTIONS ----- */
@@ -0,0 +1,269 @@
+/*
+This is a shared sampling scheduler for the oMIDItone feedback pins. It owns
+both of the Teensy 3.2's ADC modules, so the heads no longer each need their
+own ADC object, and it runs conversions on ADC0 and ADC1 at the same time so
+two feedback pins are measured for the price of one.
+
+When pins are added they are spread across the two ADCs. Not every pin can be
+read by ADC1 (A0, A11 and A14 can't), so those are put on ADC0 first, and the
+pins that either ADC can read are then handed out round-robin to whichever ADC
+has the fewest pins. With the oMIDItone's six feedback pins this ends up with
+three pins on each ADC.
+
+There are two modes the sampler can run in:
+
+FS_MODE_DMA:
+	The PDB timer triggers a conversion on both ADCs at a fixed rate and DMA
+	moves the results into a ring buffer in memory without any help from the
+	CPU. Each ADC scans through its own pins in order: every PDB trigger
+	converts the next pin in its list. A second DMA channel per ADC is triggered
+	halfway through every PDB period and writes the next pin's channel number
+	into the ADC so it is ready for the next trigger. The results land
+	interleaved in a buffer per ADC, so sample j of the pin in position p on an
+	ADC with n pins lives at buffer[j*n + p].
+
+	Since the PDB is a hardware timer, every sample has a known timestamp that
+	is simply its position in the sample stream multiplied by the trigger
+	period in CPU cycles. This means the measured time between two rising edges
+	no longer depends on how fast the main loop is running, only on how often
+	the samples are being taken.
+
+	That is also the limit on how precisely a sample can be timed. Each pin is
+	only sampled once every FS_TRIGGER_PERIOD times the number of pins on its
+	ADC, which with three pins per ADC at 200kHz is every 15us. An edge timed
+	at the sample that crossed the threshold can be off by up to that much, so
+	the ADCPeriodBackend interpolates between the samples on either side of
+	the edge to get it to well under a sample period (PB_EDGE_TIMING_INTERPOLATED).
+
+	The heads call poll() before reading, which notes how far the DMA has got.
+	read_sample() then works through the samples up to there without looking
+	at the DMA again.
+
+	The ring buffers are what let the main loop be slow without losing edges,
+	so they need to hold more than the longest time between two polls of the
+	same head. The worst loop pass is one that updates the LEDs, where
+	strip.show() alone turns off interrupts for about 3ms and the lighting
+	work adds more on top. With three pins per ADC, FS_BUFFER_SAMPLES of 1024
+	holds about 15ms per pin, or FS_MAX_POLL_INTERVAL_US once the overrun
+	margin is taken off, which leaves room for a few of those passes in a row.
+	If a slot does fall behind, its overrun_count() goes up and the backend
+	starts its edge detection over.
+
+FS_MODE_POLLED:
+	Conversions only happen when a head calls poll(). The sampler does a
+	synchronized read of that head's pin and the next pin in line on the other
+	ADC, and puts each result in a small queue for the head it belongs to,
+	timestamped with the ARM DWT cycle counter. Every poll fills two queues
+	instead of one.
+
+Either way, timestamps are in CPU cycles (96 per us at 96MHz), which is much
+finer than the 1us resolution of micros(). They are 32 bits and wrap around
+every 44 seconds or so, which is fine as long as they are only subtracted.
+
+The heads read their samples back out with read_sample(), which
+returns the oldest unread sample for a slot along with its timestamp. If a
+head doesn't read its samples for longer than its buffer can hold, the oldest
+samples are skipped and counted as overruns. This is normal for heads that are
+not currently playing anything.
+
+Copyright 2019 - kiyoshigawa - tim@twa.ninja
+*/
+
+/*
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FEEDBACK_SAMPLER_H
+#define FEEDBACK_SAMPLER_H
+
+#include <Arduino.h>
+
+//We still use the ADC library from pedvide to configure the ADCs and for polled reads.
+#include <ADC.h>
+
+//This is the Teensy DMA channel library.
+#include <DMAChannel.h>
+
+//This is the maximum number of pins that can be scanned. One per oMIDItone head.
+#define FS_MAX_PINS 6
+
+//This is the number of ADC modules on the Teensy 3.2
+#define FS_NUM_ADCS 2
+
+//These are the sampling modes that can be passed to begin():
+#define FS_MODE_POLLED 0
+#define FS_MODE_DMA 1
+
+//This is the rate in Hz that the PDB will trigger ADC conversions. Each trigger converts one pin on each ADC, so each pin is sampled at FS_SAMPLE_RATE/(pins on its ADC).
+//Keep this evenly divisible into F_BUS so that the sample timestamps in CPU cycles stay exact.
+#define FS_SAMPLE_RATE 200000
+
+//This is the number of CPU cycles between PDB triggers. DMA sample timestamps are this times the conversion number.
+#define FS_TRIGGER_PERIOD (F_CPU/FS_SAMPLE_RATE)
+
+//This is the number of samples kept per pin in the DMA ring buffers. The main loop needs to come back around before this many samples are taken or samples will be lost.
+//This needs to be a power of 2. Each ADC's buffer is FS_MAX_PINS times this many bytes, and the DMA can't count past 32767 of them.
+#define FS_BUFFER_SAMPLES 1024
+
+//When a slot has fallen behind, it is skipped ahead this many samples further than strictly needed so it isn't reading where the DMA is writing.
+#define FS_OVERRUN_MARGIN 32
+
+//This is the longest the main loop can go between polls of a head without losing samples, in us, with the oMIDItone's three pins on each ADC.
+#define FS_MAX_POLL_INTERVAL_US ((uint32_t)(FS_BUFFER_SAMPLES - FS_OVERRUN_MARGIN)*3*1000000/FS_SAMPLE_RATE)
+
+#if FS_MAX_PINS*FS_BUFFER_SAMPLES > 32767
+	#error "FS_BUFFER_SAMPLES is too big for the result DMA to count through."
+#endif
+
+//This is the number of samples kept per pin in polled mode. It only needs to hold the readings taken for a head while the other heads are polling.
+//This needs to be a power of 2.
+#define FS_POLL_QUEUE_SAMPLES 16
+
+//This is the resolution in bits of the ADC readings. The oMIDItone edge detection is built around 8-bit readings.
+#define FS_ADC_RESOLUTION 8
+
+//This is returned by add_pin() if the pin could not be added.
+#define FS_NO_SLOT 255
+
+//This is used in the pin to channel lookup for pins which can't be read by an ADC.
+#define FS_INVALID_CHANNEL 31
+
+class FeedbackSampler {
+	public:
+		//constructor function
+		FeedbackSampler();
+
+		//This will add a pin to the scan list and return the slot number to use in read_sample().
+		//If the pin is already in the list, its existing slot is returned. Returns FS_NO_SLOT on failure.
+		//Pins can be added before or after begin(), but adding a pin while running will restart sampling.
+		uint8_t add_pin(uint8_t pin);
+
+		//This will configure both ADCs, and for FS_MODE_DMA the PDB and DMA, and start sampling all added pins.
+		//It does nothing if already running.
+		void begin(uint8_t mode = FS_MODE_DMA);
+
+		//This will stop the PDB and DMA.
+		void end(void);
+
+		//This returns true if the sampler has been started.
+		bool is_running(void);
+
+		//In FS_MODE_POLLED, this takes a reading for the slot, and one for the next slot in line on the other ADC at the same time.
+		//In FS_MODE_DMA the readings are already being taken, so this notes how many of them are ready to read, skipping any that are about to be overwritten.
+		//It should be called before each pass of read_sample() calls.
+		void poll(uint8_t slot);
+
+		//This will put the oldest unread sample for the slot in value, and the CPU cycle count when it was taken in timestamp.
+		//Returns false if there are no new samples available as of the last poll(). It never starts a conversion.
+		bool read_sample(uint8_t slot, uint8_t * value, uint32_t * timestamp);
+
+		//This returns the current time in CPU cycles on the same time base as the sample timestamps, so it can be used for timeouts.
+		uint32_t current_time(void);
+
+		//This returns the number of samples that were skipped for a slot because they were not read in time.
+		uint32_t overrun_count(uint8_t slot);
+
+		//In FS_MODE_DMA, this returns the number of CPU cycles between one sample of a slot and the next.
+		//In FS_MODE_POLLED it depends on how often poll() is called, so it returns 0.
+		uint32_t sample_period(uint8_t slot);
+
+	private:
+		//This will return the SC1A channel number for a Teensy 3.2 pin on the ADC, or FS_INVALID_CHANNEL.
+		uint8_t pin_to_channel(uint8_t adc_num, uint8_t pin);
+
+		//This decides which ADC each pin is read by, and where in that ADC's scan list it goes.
+		void assign_pins_to_adcs(void);
+
+		//This sets up the PDB and the DMA channels for every ADC that has pins.
+		void begin_dma(void);
+
+		//This reads the number of times an ADC's result buffer has wrapped and the current DMA position in it without tearing.
+		void dma_position(uint8_t adc_num, uint32_t * wraps, uint32_t * position);
+
+		//This returns the total number of samples that the DMA has written for a slot since sampling began.
+		uint32_t samples_written(uint8_t slot);
+
+		//This puts a polled reading into a slot's queue, dropping the oldest reading if it is full.
+		void push_polled_sample(uint8_t slot, uint8_t value, uint32_t timestamp);
+
+		//These are called by the DMA interrupts when the result buffers wrap around.
+		static void adc0_result_dma_isr(void);
+		static void adc1_result_dma_isr(void);
+
+		//This is the sampler that is currently running, for the DMA interrupts.
+		static FeedbackSampler * active_sampler;
+
+		//this stores the pins that are being sampled, in slot order.
+		uint8_t pins[FS_MAX_PINS];
+
+		//This is the number of pins in the pins array.
+		uint8_t num_pins;
+
+		//This is the ADC that reads each slot.
+		uint8_t slot_adc[FS_MAX_PINS];
+
+		//This is the position of each slot in its ADC's scan list.
+		uint8_t slot_position[FS_MAX_PINS];
+
+		//This is the number of pins assigned to each ADC.
+		uint8_t adc_num_pins[FS_NUM_ADCS];
+
+		//This is the scan list of slots for each ADC, in position order.
+		uint8_t adc_slots[FS_NUM_ADCS][FS_MAX_PINS];
+
+		//This is the list of SC1A values written to each ADC by its mux DMA, rotated by one so the first write sets up position 1.
+		uint32_t channel_list[FS_NUM_ADCS][FS_MAX_PINS];
+
+		//This is where the DMA puts the conversion results for each ADC, interleaved by position.
+		volatile uint8_t result_buffer[FS_NUM_ADCS][FS_MAX_PINS*FS_BUFFER_SAMPLES];
+
+		//This is the number of times the DMA has wrapped around each result buffer.
+		volatile uint32_t result_buffer_wraps[FS_NUM_ADCS];
+
+		//These are the small per-slot queues for polled mode, along with the time each reading was taken.
+		uint8_t poll_queue[FS_MAX_PINS][FS_POLL_QUEUE_SAMPLES];
+		uint32_t poll_queue_times[FS_MAX_PINS][FS_POLL_QUEUE_SAMPLES];
+
+		//This is the number of polled samples that have been put into each slot's queue.
+		uint32_t samples_queued[FS_MAX_PINS];
+
+		//This is the next position on each ADC to be read along with another ADC's pin in polled mode.
+		uint8_t next_poll_position[FS_NUM_ADCS];
+
+		//This is the number of samples each slot has read out so far.
+		uint32_t samples_read[FS_MAX_PINS];
+
+		//This is the number of samples the DMA had written for each slot at the last poll(), which read_sample() reads up to.
+		uint32_t samples_ready[FS_MAX_PINS];
+
+		//This is the number of samples skipped for each slot because they were overwritten before being read.
+		uint32_t samples_overrun[FS_MAX_PINS];
+
+		//This is the mode that was passed to begin().
+		uint8_t sampling_mode;
+
+		//This is true while the sampler is running.
+		bool running;
+
+		//This is the one ADC library object for the whole controller.
+		ADC * adc;
+
+		//These DMA channels move conversion results out of each ADC.
+		DMAChannel result_dma[FS_NUM_ADCS];
+
+		//These DMA channels write the next pin's channel into each ADC every PDB period.
+		DMAChannel mux_dma[FS_NUM_ADCS];
+};
+
+#endif
@@ -0,0 +1,140 @@
+/*
+This is the ADCPeriodBackend library, which finds the rising edges of an
+oMIDItone head's waveform in the samples taken by the FeedbackSampler.
+
+Copyright 2019 - kiyoshigawa - tim@twa.ninja
+*/
+/*
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ADCPeriodBackend.h>
+
+ADCPeriodBackend::ADCPeriodBackend(FeedbackSampler * feedback_sampler, uint8_t pin)
+{
+	edge_timing_mode = PB_EDGE_TIMING_DEFAULT;
+	last_analog_read = 1024;
+	last_analog_read_time = 0;
+	last_dropped_count = 0;
+	edge_level_max = 0;
+	edge_level_min = 0;
+	rising_edge_armed = false;
+
+	sampler = feedback_sampler;
+	sampler_slot = sampler->add_pin(pin);
+}
+
+/* ----- PUBLIC FUNCTIONS BELOW ----- */
+
+void ADCPeriodBackend::begin(void)
+{
+	//The sampler is shared, so this will only start it on the first head to be initialized.
+	#ifdef PB_DMA_SAMPLING
+		sampler->begin(FS_MODE_DMA);
+	#else
+		sampler->begin(FS_MODE_POLLED);
+	#endif
+}
+
+bool ADCPeriodBackend::read_edge(uint32_t * edge_time)
+{
+	//when polling, this takes a new reading. With DMA the readings are already waiting, and this notes how many there are.
+	sampler->poll(sampler_slot);
+	uint8_t sample;
+	uint32_t sample_time;
+	//work through the queued samples in order, stopping at the first rising edge so the caller can handle it:
+	while(sampler->read_sample(sampler_slot, &sample, &sample_time)){
+		if(check_rising_edge(sample, sample_time, edge_time)){
+			return true;
+		}
+	}
+	return false;
+}
+
+uint32_t ADCPeriodBackend::current_time(void)
+{
+	return sampler->current_time();
+}
+
+void ADCPeriodBackend::set_edge_timing(uint8_t mode)
+{
+	edge_timing_mode = mode;
+}
+
+uint32_t ADCPeriodBackend::dropped_count(void)
+{
+	return sampler->overrun_count(sampler_slot);
+}
+
+/* ----- END PUBLIC FUNCTIONS ----- */
+/* ----- PRIVATE FUNCTIONS BELOW ----- */
+
+bool ADCPeriodBackend::check_rising_edge(uint16_t analog_read, uint32_t sample_time, uint32_t * edge_time)
+{
+	//set the thresholds based on the waveform so far:
+	uint32_t span = edge_level_max - edge_level_min;
+	uint16_t high_threshold = (edge_level_min + span*PB_RISING_EDGE_HIGH_FRACTION/100) >> PB_EDGE_LEVEL_FRAC_BITS;
+	uint16_t low_threshold = (edge_level_min + span*PB_RISING_EDGE_LOW_FRACTION/100) >> PB_EDGE_LEVEL_FRAC_BITS;
+
+	//if samples were skipped, the waveform could have done anything in between, so wait for it to go below the low threshold again:
+	uint32_t dropped = sampler->overrun_count(sampler_slot);
+	if(dropped != last_dropped_count){
+		last_dropped_count = dropped;
+		rising_edge_armed = false;
+	}
+
+	//only count an edge when the reading crosses the high threshold after having been below the low one:
+	bool edge_found = false;
+	if(span >= ((uint32_t)PB_MIN_EDGE_SPAN << PB_EDGE_LEVEL_FRAC_BITS)){
+		if(analog_read < low_threshold){
+			rising_edge_armed = true;
+		} else if(rising_edge_armed && analog_read > high_threshold){
+			rising_edge_armed = false;
+			edge_found = true;
+		}
+	}
+
+	//update the top and bottom of the waveform. New extremes are taken right away, otherwise they creep towards the reading so they can follow the amplitude back down.
+	uint32_t level = (uint32_t)analog_read << PB_EDGE_LEVEL_FRAC_BITS;
+	if(level > edge_level_max){
+		edge_level_max = level;
+	} else {
+		edge_level_max -= (edge_level_max - level) >> PB_EDGE_LEVEL_DECAY_SHIFT;
+	}
+	if(level < edge_level_min){
+		edge_level_min = level;
+	} else {
+		edge_level_min += (level - edge_level_min) >> PB_EDGE_LEVEL_DECAY_SHIFT;
+	}
+
+	if(edge_found){
+		*edge_time = sample_time;
+		uint32_t sample_gap = sample_time - last_analog_read_time;
+		uint32_t max_gap = sampler->sample_period(sampler_slot)*PB_MAX_INTERPOLATION_SAMPLES;
+		if(max_gap == 0){
+			max_gap = PB_MAX_POLLED_INTERPOLATION_CYCLES;
+		}
+		if(edge_timing_mode == PB_EDGE_TIMING_INTERPOLATED && sample_gap <= max_gap && last_analog_read < high_threshold){
+			//the edge happened somewhere between the two samples, at the fraction of the gap where a straight line between them crosses the threshold.
+			//the fraction is worked out in 1/256ths so the multiply can't overflow.
+			uint32_t fraction = ((uint32_t)(high_threshold - last_analog_read) << 8)/(analog_read - last_analog_read);
+			*edge_time = last_analog_read_time + ((sample_gap*fraction) >> 8);
+		}
+	}
+	last_analog_read = analog_read;
+	last_analog_read_time = sample_time;
+	return edge_found;
+}
+
+/* ----- END PRIVATE FUNCTIONS ----- */
@@ -0,0 +1,122 @@
+/*
+This is the period measurement backend for feedback pins that are read by the
+ADCs. The samples come from the shared FeedbackSampler, and the edges are found
+in software.
+
+Each backend tracks the top and bottom of its own waveform, since the amplitude
+is different on every head and changes with pitch and servo position. A rising
+edge is counted when the reading goes above PB_RISING_EDGE_HIGH_FRACTION of the
+way from the bottom to the top, but only if it has been below
+PB_RISING_EDGE_LOW_FRACTION since the last edge. The gap between the two is
+hysteresis, so noise near the threshold can't count as extra edges.
+
+Copyright 2019 - kiyoshigawa - tim@twa.ninja
+*/
+
+/*
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ADC_PERIOD_BACKEND_H
+#define ADC_PERIOD_BACKEND_H
+
+#include <Arduino.h>
+#include <PeriodBackend.h>
+
+//This shares the ADCs between all the heads and samples the feedback pins.
+#include <FeedbackSampler.h>
+
+//comment this out to go back to polling the feedback pins every time the loop checks for a rising edge.
+//When enabled, the feedback pins are sampled at a fixed rate by the FeedbackSampler and the heads read back the buffered samples.
+#define PB_DMA_SAMPLING
+
+//These are the rising edge thresholds as a fraction of the waveform's height, as numbers from 0-100.
+#define PB_RISING_EDGE_HIGH_FRACTION 30
+#define PB_RISING_EDGE_LOW_FRACTION 10
+
+//This is how quickly the tracked top and bottom of the waveform move back towards the current reading, as a bit shift per sample.
+//New highs and lows are taken immediately. Larger numbers decay more slowly. 12 is a time constant of 4096 samples.
+#define PB_EDGE_LEVEL_DECAY_SHIFT 12
+
+//This is the number of fractional bits used when tracking the top and bottom of the waveform, so the slow decay isn't rounded away.
+#define PB_EDGE_LEVEL_FRAC_BITS 16
+
+//If the top and bottom of the waveform are closer than this on an 8-bit reading, there is no signal to find edges in.
+#define PB_MIN_EDGE_SPAN 16
+
+//this controls the default edge timing mode
+#define PB_EDGE_TIMING_DEFAULT PB_EDGE_TIMING_INTERPOLATED
+
+//If the samples on either side of an edge are further apart than this many of the sampler's sample periods, the edge is not interpolated.
+//Anything longer means samples were missed in between, and a straight line across the gap would put the edge in the wrong place.
+#define PB_MAX_INTERPOLATION_SAMPLES 2
+
+//In polled mode the samples don't come at a fixed rate, so this many CPU cycles is used as the longest gap to interpolate across instead.
+#define PB_MAX_POLLED_INTERPOLATION_CYCLES (F_CPU/10000)
+
+class ADCPeriodBackend : public PeriodBackend {
+	public:
+		//constructor function
+		//The feedback_sampler is shared by all the heads. The pin is registered with it right away, but the hardware isn't touched until begin().
+		ADCPeriodBackend(FeedbackSampler * feedback_sampler, uint8_t pin);
+
+		//This starts the shared sampler if it isn't already running.
+		void begin(void);
+
+		//This works through the sampler's queued samples until it finds a rising edge or runs out.
+		bool read_edge(uint32_t * edge_time);
+
+		//This returns the sampler's current time.
+		uint32_t current_time(void);
+
+		//This sets PB_EDGE_TIMING_RAW or PB_EDGE_TIMING_INTERPOLATED.
+		void set_edge_timing(uint8_t mode);
+
+		//This returns the number of samples the sampler had to skip for this pin.
+		uint32_t dropped_count(void);
+
+	private:
+		//This takes a single analog reading and the cycle count when it was taken, and returns true if it completes a rising edge.
+		//The thresholds come from the tracked top and bottom of the waveform, which are updated with each reading.
+		//Depending on edge_timing_mode, the edge is timed at this sample or interpolated between this sample and the one before it.
+		//If samples were skipped since the last one, a crossing across the gap can't be timed, so it isn't counted as an edge.
+		bool check_rising_edge(uint16_t analog_read, uint32_t sample_time, uint32_t * edge_time);
+
+		//This is the shared sampler that owns the ADCs and reads the feedback pin.
+		FeedbackSampler * sampler;
+
+		//This is the slot on the sampler that belongs to this pin.
+		uint8_t sampler_slot;
+
+		//this is the edge timing mode set by set_edge_timing()
+		uint8_t edge_timing_mode;
+
+		//this is a variable for storing the most recent analog reading
+		uint16_t last_analog_read;
+
+		//this is the CPU cycle count when last_analog_read was taken, for interpolating edges.
+		uint32_t last_analog_read_time;
+
+		//this is the sampler's overrun count for this pin as of the last sample, to tell when samples have been skipped.
+		uint32_t last_dropped_count;
+
+		//these are the tracked top and bottom of the waveform, as fixed point numbers with PB_EDGE_LEVEL_FRAC_BITS fractional bits.
+		uint32_t edge_level_max;
+		uint32_t edge_level_min;
+
+		//this is true once the waveform has gone below the low threshold, and a rising edge can be counted.
+		bool rising_edge_armed;
+};
+
+#endif
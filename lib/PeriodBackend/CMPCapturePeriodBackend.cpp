@@ -0,0 +1,192 @@
+/*
+This is the CMPCapturePeriodBackend library, which timestamps the rising edges
+of an oMIDItone head's waveform with an analog comparator and FlexTimer input
+capture.
+
+Copyright 2019 - kiyoshigawa - tim@twa.ninja
+*/
+/*
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <CMPCapturePeriodBackend.h>
+
+CMPCapturePeriodBackend * CMPCapturePeriodBackend::active_backends[PB_NUM_COMPARATORS] = {NULL, NULL};
+
+CMPCapturePeriodBackend::CMPCapturePeriodBackend(uint8_t pin, uint8_t threshold)
+{
+	input_pin = pin;
+	comparator = pin_to_comparator(pin, &comparator_input);
+	dac_level = threshold >> 2;
+	overflow_count = 0;
+	captures_written = 0;
+	captures_read = 0;
+	captures_dropped = 0;
+	for(int i=0; i<PB_CAPTURE_QUEUE_EDGES; i++){
+		capture_queue[i] = 0;
+	}
+	if(comparator == 0){
+		ftm_sc = &FTM1_SC;
+		ftm_cnt = &FTM1_CNT;
+		ftm_mod = &FTM1_MOD;
+		ftm_c0sc = &FTM1_C0SC;
+		ftm_c0v = &FTM1_C0V;
+		ftm_irq = IRQ_FTM1;
+	} else {
+		ftm_sc = &FTM2_SC;
+		ftm_cnt = &FTM2_CNT;
+		ftm_mod = &FTM2_MOD;
+		ftm_c0sc = &FTM2_C0SC;
+		ftm_c0v = &FTM2_C0V;
+		ftm_irq = IRQ_FTM2;
+	}
+}
+
+/* ----- PUBLIC FUNCTIONS BELOW ----- */
+
+void CMPCapturePeriodBackend::begin(void)
+{
+	if(comparator == PB_NO_COMPARATOR || active_backends[comparator] == this){
+		return;
+	}
+
+	//the pin needs to be in analog mode for the comparator to see it:
+	*portConfigRegister(input_pin) = PORT_PCR_MUX(0);
+
+	//set up the comparator to compare the pin against its DAC:
+	SIM_SCGC4 |= SIM_SCGC4_CMP;
+	volatile uint8_t * cmp_registers = (comparator == 0) ? &CMP0_CR0 : &CMP1_CR0;
+	//CR0: no filtering, and the largest hysteresis setting
+	cmp_registers[0] = 0x03;
+	//FPR: filter disabled
+	cmp_registers[2] = 0x00;
+	//DACCR: DAC enabled, referenced to VDD, set to the threshold
+	cmp_registers[4] = 0x80 | 0x40 | (dac_level & 0x3F);
+	//MUXCR: the plus input is the pin, and the minus input is the DAC, which is input 7
+	cmp_registers[5] = (comparator_input << 3) | 7;
+	//CR1: enabled, in high speed mode
+	cmp_registers[1] = 0x10 | 0x01;
+
+	//route the comparator output to channel 0 of its FlexTimer instead of the pin:
+	if(comparator == 0){
+		SIM_SCGC6 |= SIM_SCGC6_FTM1;
+		SIM_SOPT4 = (SIM_SOPT4 & ~(3 << 18)) | (1 << 18); //FTM1CH0SRC = CMP0
+	} else {
+		SIM_SCGC3 |= SIM_SCGC3_FTM2;
+		SIM_SOPT4 = (SIM_SOPT4 & ~(3 << 20)) | (2 << 20); //FTM2CH0SRC = CMP1
+	}
+
+	//set up the FlexTimer to free run from the bus clock with an overflow interrupt, and capture rising edges on channel 0:
+	active_backends[comparator] = this;
+	*ftm_sc = 0;
+	*ftm_cnt = 0;
+	*ftm_mod = 0xFFFF;
+	*ftm_c0sc = FTM_CSC_CHIE | FTM_CSC_ELSA;
+	*ftm_sc = FTM_SC_CLKS(1) | FTM_SC_PS(0) | FTM_SC_TOIE;
+	if(comparator == 0){
+		attachInterruptVector(IRQ_FTM1, ftm1_isr);
+	} else {
+		attachInterruptVector(IRQ_FTM2, ftm2_isr);
+	}
+	NVIC_ENABLE_IRQ(ftm_irq);
+}
+
+bool CMPCapturePeriodBackend::read_edge(uint32_t * edge_time)
+{
+	if(captures_read == captures_written){
+		return false;
+	}
+	*edge_time = capture_queue[captures_read & (PB_CAPTURE_QUEUE_EDGES-1)]*PB_CYCLES_PER_FTM_COUNT;
+	captures_read++;
+	return true;
+}
+
+uint32_t CMPCapturePeriodBackend::current_time(void)
+{
+	//before begin() the FlexTimer interrupt isn't running, so there is nothing to mask:
+	bool is_started = comparator != PB_NO_COMPARATOR && active_backends[comparator] == this;
+	//read the count and the overflows together, and count a pending overflow that the interrupt hasn't gotten to yet.
+	//only the FlexTimer interrupt changes overflow_count, so only it is masked, and the other interrupts can still run:
+	if(is_started){
+		NVIC_DISABLE_IRQ(ftm_irq);
+	}
+	uint32_t count = *ftm_cnt;
+	uint32_t overflows = overflow_count;
+	if((*ftm_sc & FTM_SC_TOF) && count < 0x8000){
+		overflows++;
+	}
+	if(is_started){
+		NVIC_ENABLE_IRQ(ftm_irq);
+	}
+	return ((overflows << 16) | count)*PB_CYCLES_PER_FTM_COUNT;
+}
+
+uint32_t CMPCapturePeriodBackend::dropped_count(void)
+{
+	return captures_dropped;
+}
+
+/* ----- END PUBLIC FUNCTIONS ----- */
+/* ----- PRIVATE FUNCTIONS BELOW ----- */
+
+void CMPCapturePeriodBackend::handle_interrupt(void)
+{
+	if(*ftm_c0sc & FTM_CSC_CHF){
+		uint32_t capture = *ftm_c0v;
+		uint32_t overflows = overflow_count;
+		//if the timer overflowed and the capture happened after it, the overflow hasn't been counted yet:
+		if((*ftm_sc & FTM_SC_TOF) && capture < 0x8000){
+			overflows++;
+		}
+		*ftm_c0sc &= ~FTM_CSC_CHF;
+		if(captures_written - captures_read < PB_CAPTURE_QUEUE_EDGES){
+			capture_queue[captures_written & (PB_CAPTURE_QUEUE_EDGES-1)] = (overflows << 16) | capture;
+			captures_written++;
+		} else {
+			captures_dropped++;
+		}
+	}
+	if(*ftm_sc & FTM_SC_TOF){
+		*ftm_sc &= ~FTM_SC_TOF;
+		overflow_count++;
+	}
+}
+
+uint8_t CMPCapturePeriodBackend::pin_to_comparator(uint8_t pin, uint8_t * input)
+{
+	//These are the Teensy 3.2 comparator inputs from the schematic:
+	switch(pin){
+		case 11: *input = 0; return 0;
+		case 12: *input = 1; return 0;
+		case 23: *input = 0; return 1;
+		case 9: *input = 1; return 1;
+		default: *input = 0; return PB_NO_COMPARATOR;
+	}
+}
+
+void CMPCapturePeriodBackend::ftm1_isr(void)
+{
+	if(active_backends[0] != NULL){
+		active_backends[0]->handle_interrupt();
+	}
+}
+
+void CMPCapturePeriodBackend::ftm2_isr(void)
+{
+	if(active_backends[1] != NULL){
+		active_backends[1]->handle_interrupt();
+	}
+}
+
+/* ----- END PRIVATE FUNCTIONS ----- */
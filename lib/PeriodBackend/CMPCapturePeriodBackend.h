@@ -0,0 +1,130 @@
+/*
+This is the period measurement backend that finds rising edges in hardware. One
+of the Teensy 3.2's analog comparators compares the waveform against its
+built-in 6-bit DAC, and the comparator output is routed straight into a
+FlexTimer channel 0 set up for input capture. The timer latches its count on
+every rising edge of the comparator output, and the interrupt just moves the
+captured count into a small queue, so there is no polling cost at all.
+
+The comparator outputs can only be routed to channel 0 of FTM1 and FTM2, so
+this can be used for at most two heads:
+	CMP0 -> FTM1 channel 0, with inputs on pin 11 (CMP0_IN0) and pin 12 (CMP0_IN1)
+	CMP1 -> FTM2 channel 0, with inputs on pin 23 (CMP1_IN0) and pin 9 (CMP1_IN1)
+None of these are the feedback pins on the current controller board, and pins
+11 and 12 are also SPI0, so a head needs to be rewired to use this backend.
+
+The FlexTimers run from the 48MHz bus clock and only count to 16 bits, so the
+overflows are counted in the interrupt to extend the captures to 32 bits. They
+are then scaled up to CPU cycles to match the other backends.
+
+The FlexTimer interrupt handlers are only attached when a backend is started
+with begin(), so FTM1 and FTM2 are left alone for anything else to use when
+this backend isn't.
+
+The comparator's threshold is fixed, unlike the ADC backend's, so the
+comparator hysteresis is turned all the way up to make up for it.
+
+Copyright 2019 - kiyoshigawa - tim@twa.ninja
+*/
+
+/*
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CMP_CAPTURE_PERIOD_BACKEND_H
+#define CMP_CAPTURE_PERIOD_BACKEND_H
+
+#include <Arduino.h>
+#include <PeriodBackend.h>
+
+//This is the number of captured edges that can be waiting to be read. It needs to be a power of 2.
+#define PB_CAPTURE_QUEUE_EDGES 16
+
+//This is the number of comparators that can be routed into a FlexTimer.
+#define PB_NUM_COMPARATORS 2
+
+//This is the default comparator threshold as an 8-bit reading, to match the ADC backend's readings. The DAC only has 6 bits, so it is rounded down.
+#define PB_DEFAULT_CAPTURE_THRESHOLD 50
+
+//This is the number of CPU cycles per FlexTimer count.
+#define PB_CYCLES_PER_FTM_COUNT (F_CPU/F_BUS)
+
+//This is returned by pin_to_comparator() for pins that aren't comparator inputs.
+#define PB_NO_COMPARATOR 255
+
+class CMPCapturePeriodBackend : public PeriodBackend {
+	public:
+		//constructor function
+		//The pin needs to be one of the comparator inputs listed above. The threshold is an 8-bit reading, from 0 at ground to 255 at 3.3V.
+		CMPCapturePeriodBackend(uint8_t pin, uint8_t threshold = PB_DEFAULT_CAPTURE_THRESHOLD);
+
+		//This sets up the comparator and the FlexTimer, and starts capturing edges.
+		void begin(void);
+
+		//This takes the oldest captured edge out of the queue.
+		bool read_edge(uint32_t * edge_time);
+
+		//This returns the current FlexTimer count, extended and scaled the same way as the captures.
+		uint32_t current_time(void);
+
+		//This returns the number of edges that were captured while the queue was full.
+		uint32_t dropped_count(void);
+
+	private:
+		//This moves a capture into the queue and counts overflows. It is called from the FlexTimer interrupts.
+		void handle_interrupt(void);
+
+		//These are the FlexTimer interrupts, which are attached by begin().
+		static void ftm1_isr(void);
+		static void ftm2_isr(void);
+
+		//These are the backends that have been started on each comparator, for the interrupts.
+		static CMPCapturePeriodBackend * active_backends[PB_NUM_COMPARATORS];
+
+		//This returns the comparator number for a pin, and puts its comparator input number in input. Returns PB_NO_COMPARATOR if it isn't an input.
+		static uint8_t pin_to_comparator(uint8_t pin, uint8_t * input);
+
+		//This is the pin the waveform is connected to.
+		uint8_t input_pin;
+
+		//This is the comparator the pin is on, and the comparator input it uses.
+		uint8_t comparator;
+		uint8_t comparator_input;
+
+		//This is the 6-bit DAC setting for the threshold.
+		uint8_t dac_level;
+
+		//These are the FlexTimer registers for the comparator's timer.
+		volatile uint32_t * ftm_sc;
+		volatile uint32_t * ftm_cnt;
+		volatile uint32_t * ftm_mod;
+		volatile uint32_t * ftm_c0sc;
+		volatile uint32_t * ftm_c0v;
+
+		//This is the FlexTimer's interrupt number. current_time() masks just this one, so it doesn't hold up the other interrupts.
+		uint8_t ftm_irq;
+
+		//This is the number of times the FlexTimer has overflowed, which makes up the top 16 bits of the timestamps.
+		volatile uint32_t overflow_count;
+
+		//These are the captured edges waiting to be read, as extended FlexTimer counts.
+		volatile uint32_t capture_queue[PB_CAPTURE_QUEUE_EDGES];
+		volatile uint32_t captures_written;
+		uint32_t captures_read;
+
+		//This is the number of edges that were thrown out because the queue was full.
+		volatile uint32_t captures_dropped;
+};
+
+#endif
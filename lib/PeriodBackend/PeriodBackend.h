@@ -0,0 +1,85 @@
+/*
+This is the interface that the oMIDItone heads use to find the rising edges of
+their output waveform. Everything a head needs to measure its frequency comes
+through here, so the way the edges are found can be swapped out without
+touching the pitch correction code.
+
+There are three backends that implement it:
+
+ADCPeriodBackend:
+	Reads the feedback pin through the shared FeedbackSampler and finds the
+	edges in software. This is what the controller board is wired for.
+
+CMPCapturePeriodBackend:
+	Uses one of the analog comparators to square up the waveform and feeds it
+	into a FlexTimer input capture channel, which timestamps the edges in
+	hardware. The CPU only has to move the timestamps into a queue.
+
+SimulatedPeriodBackend:
+	Makes up the edges from a simple model of the otamatone oscillator, so the
+	pitch correction can be run and compared without a head attached. It is in
+	its own library and is only built off the Teensy, for the host tests.
+
+All the timestamps are in CPU cycles. They are 32 bits and are only ever
+subtracted, so it doesn't matter where each backend's time base starts or that
+it wraps around.
+
+Copyright 2019 - kiyoshigawa - tim@twa.ninja
+*/
+
+/*
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PERIOD_BACKEND_H
+#define PERIOD_BACKEND_H
+
+//this header is also used by the host tests, which don't have the Arduino core:
+#ifdef __arm__
+	#include <Arduino.h>
+#else
+	#include <stdint.h>
+#endif
+
+//These are the ways a rising edge can be timestamped, for use with set_edge_timing() on backends that find edges in sampled data:
+//PB_EDGE_TIMING_RAW uses the time of the first sample above the threshold, so every edge can be off by up to one sample interval.
+//PB_EDGE_TIMING_INTERPOLATED draws a line between the samples on either side of the threshold and uses the time where it crosses.
+#define PB_EDGE_TIMING_RAW 0
+#define PB_EDGE_TIMING_INTERPOLATED 1
+
+class PeriodBackend {
+	public:
+		virtual ~PeriodBackend() {}
+
+		//This will set up any hardware the backend needs. It is called from each head's init(), so shared hardware should only be started once.
+		virtual void begin(void) = 0;
+
+		//This will put the time of the oldest rising edge that hasn't been read yet in edge_time, in CPU cycles.
+		//Returns false if there are no new edges. It should be called often enough that no edges are lost.
+		virtual bool read_edge(uint32_t * edge_time) = 0;
+
+		//This returns the current time in CPU cycles on the same time base as the edge timestamps, so it can be used for timeouts.
+		virtual uint32_t current_time(void) = 0;
+
+		//This lets the backend know what resistance the head was just set to. Only the simulated backend cares.
+		virtual void resistance_changed(uint16_t resistance) {}
+
+		//This sets how edges are timestamped, for backends that find edges in sampled data. It does nothing for the others.
+		virtual void set_edge_timing(uint8_t mode) {}
+
+		//This returns the number of edges or samples that were lost because they weren't read in time, for comparing backends.
+		virtual uint32_t dropped_count(void) { return 0; }
+};
+
+#endif
@@ -0,0 +1,144 @@
+/*
+This is the PeriodEstimator library, a streaming mean, median and trimmed mean
+over a small ring buffer of period readings.
+
+Copyright 2019 - kiyoshigawa - tim@twa.ninja
+*/
+/*
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <PeriodEstimator.h>
+
+PeriodEstimator::PeriodEstimator()
+{
+	max_readings = PE_MAX_SAMPLES;
+	estimation_mode = PE_MODE_MEAN;
+	trim_count = 0;
+	reset();
+}
+
+/* ----- PUBLIC FUNCTIONS BELOW ----- */
+
+void PeriodEstimator::begin(uint8_t num_samples, uint8_t mode, uint8_t trim)
+{
+	if(num_samples < 1){
+		num_samples = 1;
+	}
+	if(num_samples > PE_MAX_SAMPLES){
+		num_samples = PE_MAX_SAMPLES;
+	}
+	max_readings = num_samples;
+	estimation_mode = mode;
+	trim_count = trim;
+	reset();
+}
+
+void PeriodEstimator::reset(void)
+{
+	ring_index = 0;
+	num_readings = 0;
+	total = 0;
+	for(int i=0; i<PE_MAX_SAMPLES; i++){
+		ring[i] = 0;
+		sorted[i] = 0;
+	}
+}
+
+void PeriodEstimator::add(uint32_t value)
+{
+	uint8_t position;
+	if(num_readings >= max_readings){
+		//take the oldest reading out of the sorted copy by shifting everything above it down one:
+		uint32_t oldest = ring[ring_index];
+		total -= oldest;
+		position = 0;
+		while(sorted[position] != oldest){
+			position++;
+		}
+		for(; position < num_readings-1; position++){
+			sorted[position] = sorted[position+1];
+		}
+		num_readings--;
+	}
+
+	//put the new reading into the sorted copy by shifting everything above it up one:
+	position = num_readings;
+	while(position > 0 && sorted[position-1] > value){
+		sorted[position] = sorted[position-1];
+		position--;
+	}
+	sorted[position] = value;
+	num_readings++;
+	total += value;
+
+	ring[ring_index] = value;
+	ring_index = (ring_index + 1) % max_readings;
+}
+
+uint32_t PeriodEstimator::estimate(void)
+{
+	if(num_readings == 0){
+		return 0;
+	}
+	switch(estimation_mode){
+		case PE_MODE_MEDIAN:
+			if(num_readings % 2){
+				return sorted[num_readings/2];
+			}
+			return (sorted[num_readings/2 - 1] + sorted[num_readings/2])/2;
+		case PE_MODE_TRIMMED_MEAN: {
+			//don't trim so much that there is nothing left:
+			uint8_t trim = trim_count;
+			if(2*trim >= num_readings){
+				trim = (num_readings-1)/2;
+			}
+			uint32_t trimmed_total = total;
+			for(uint8_t i=0; i<trim; i++){
+				trimmed_total -= sorted[i] + sorted[num_readings-1-i];
+			}
+			return trimmed_total/(num_readings - 2*trim);
+		}
+		default:
+			return total/num_readings;
+	}
+}
+
+uint32_t PeriodEstimator::lowest(void)
+{
+	if(num_readings == 0){
+		return 0;
+	}
+	return sorted[0];
+}
+
+uint32_t PeriodEstimator::highest(void)
+{
+	if(num_readings == 0){
+		return 0;
+	}
+	return sorted[num_readings-1];
+}
+
+uint8_t PeriodEstimator::count(void)
+{
+	return num_readings;
+}
+
+bool PeriodEstimator::is_full(void)
+{
+	return num_readings >= max_readings;
+}
+
+/* ----- END PUBLIC FUNCTIONS ----- */
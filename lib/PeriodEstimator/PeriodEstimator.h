@@ -0,0 +1,113 @@
+/*
+This is a small streaming estimator for the oMIDItone period measurements. It
+keeps the most recent readings in a ring buffer, and also keeps a sorted copy
+of them that is updated as each reading comes in, so it never has to sort or
+re-add the whole buffer.
+
+A plain mean lets a single glitchy reading (a servo moving or the LEDs being
+updated at the wrong moment) drag the result far enough off to make a
+correction in the wrong direction. The median or a trimmed mean of the same
+readings just ignores it.
+
+There are three modes:
+
+PE_MODE_MEAN:
+	The plain average of the readings, from a running total.
+
+PE_MODE_MEDIAN:
+	The middle reading. For an even number of readings it is the average of the
+	two middle ones.
+
+PE_MODE_TRIMMED_MEAN:
+	The average of the readings after throwing out the trim highest and trim
+	lowest ones.
+
+Adding a reading is not constant time. The running total is, but keeping the
+sorted copy in order takes a removal and an insertion that can each shift every
+entry, so it is O(N) in the number of readings. The buffer is at most
+PE_MAX_SAMPLES long, so that is at most a few dozen word moves for each edge,
+which costs less than the bookkeeping of a heap or a tree would at this size.
+Getting the estimate is at most a few additions no matter which mode is used.
+
+Copyright 2019 - kiyoshigawa - tim@twa.ninja
+*/
+
+/*
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PERIOD_ESTIMATOR_H
+#define PERIOD_ESTIMATOR_H
+
+#include <Arduino.h>
+
+//This is the largest number of readings that can be kept. Keep it small, since each new reading shifts the sorted copy.
+#define PE_MAX_SAMPLES 15
+
+//These are the estimation modes that can be passed to begin():
+#define PE_MODE_MEAN 0
+#define PE_MODE_MEDIAN 1
+#define PE_MODE_TRIMMED_MEAN 2
+
+class PeriodEstimator {
+	public:
+		//constructor function
+		PeriodEstimator();
+
+		//This sets the number of readings to keep, the estimation mode, and for PE_MODE_TRIMMED_MEAN the number of readings to trim from each end.
+		//It also empties the buffer. num_samples is limited to PE_MAX_SAMPLES, and trim is limited so that at least one reading is left.
+		void begin(uint8_t num_samples, uint8_t mode, uint8_t trim = 1);
+
+		//This throws out all the readings.
+		void reset(void);
+
+		//This adds a reading, replacing the oldest one if the buffer is full. It is O(N) in the number of readings, see above.
+		void add(uint32_t value);
+
+		//This returns the estimate for the readings in the buffer, or 0 if there are none.
+		uint32_t estimate(void);
+
+		//These return the smallest and largest readings in the buffer, or 0 if there are none.
+		uint32_t lowest(void);
+		uint32_t highest(void);
+
+		//This returns the number of readings in the buffer.
+		uint8_t count(void);
+
+		//This returns true once the buffer has num_samples readings in it.
+		bool is_full(void);
+
+	private:
+		//This is the readings in the order they were added.
+		uint32_t ring[PE_MAX_SAMPLES];
+
+		//This is the same readings, sorted from smallest to largest.
+		uint32_t sorted[PE_MAX_SAMPLES];
+
+		//This is where the next reading goes in the ring.
+		uint8_t ring_index;
+
+		//This is the number of readings currently in the buffer.
+		uint8_t num_readings;
+
+		//These are the settings from begin().
+		uint8_t max_readings;
+		uint8_t estimation_mode;
+		uint8_t trim_count;
+
+		//This is the sum of all the readings in the buffer.
+		uint32_t total;
+};
+
+#endif
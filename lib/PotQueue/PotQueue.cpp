@@ -0,0 +1,181 @@
+/*
+This is the PotQueue library, which collects wiper commands for the digital
+pots on all of the oMIDItone heads and sends them over SPI in the background.
+
+Copyright 2019 - kiyoshigawa - tim@twa.ninja
+*/
+/*
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <PotQueue.h>
+
+PotQueue * PotQueue::active_queue = NULL;
+
+PotQueue::PotQueue()
+{
+	num_chips = 0;
+	for(int i=0; i<PQ_MAX_CHIPS; i++){
+		cs_pins[i] = 0;
+		cs_set_registers[i] = NULL;
+		cs_clear_registers[i] = NULL;
+		pending_commands[i] = 0;
+		chip_is_pending[i] = false;
+		send_order[i] = 0;
+	}
+	send_order_start = 0;
+	send_order_count = 0;
+	chip_in_flight = PQ_NO_CHIP;
+	coalesced_commands = 0;
+	running = false;
+}
+
+/* ----- PUBLIC FUNCTIONS BELOW ----- */
+
+uint8_t PotQueue::add_chip(uint8_t cs_pin)
+{
+	//if the pin has already been added, hand back the same chip:
+	for(uint8_t chip=0; chip<num_chips; chip++){
+		if(cs_pins[chip] == cs_pin){
+			return chip;
+		}
+	}
+	if(num_chips >= PQ_MAX_CHIPS){
+		return PQ_NO_CHIP;
+	}
+	uint8_t chip = num_chips;
+	cs_pins[chip] = cs_pin;
+	cs_set_registers[chip] = portSetRegister(cs_pin);
+	cs_clear_registers[chip] = portClearRegister(cs_pin);
+	num_chips++;
+	//if the queue is already running, the new pin needs to be set up now:
+	if(running){
+		pinMode(cs_pin, OUTPUT);
+		*cs_set_registers[chip] = 1;
+	}
+	return chip;
+}
+
+void PotQueue::begin(void)
+{
+	if(running){
+		return;
+	}
+	active_queue = this;
+
+	//all the pots start out de-selected:
+	for(uint8_t chip=0; chip<num_chips; chip++){
+		pinMode(cs_pins[chip], OUTPUT);
+		*cs_set_registers[chip] = 1;
+	}
+
+	//let the SPI library set up the clock and frame sizes. CTAR1 is set up for 16 bit frames, the same as transfer16() uses.
+	//Nothing else on the controller uses SPI, so the settings stay put after the transaction ends.
+	SPI.begin();
+	SPI.beginTransaction(SPISettings(PQ_SPI_CLOCK, MSBFIRST, SPI_MODE0));
+	SPI.endTransaction();
+
+	//interrupt every time a frame is received, which is when the frame that was sent has finished:
+	SPI0_SR = SPI_SR_RFDF;
+	SPI0_RSER = SPI_RSER_RFDF_RE;
+	attachInterruptVector(IRQ_SPI0, spi0_isr);
+	NVIC_ENABLE_IRQ(IRQ_SPI0);
+	running = true;
+}
+
+void PotQueue::write(uint8_t chip, uint16_t command)
+{
+	if(chip >= num_chips){
+		return;
+	}
+	//if this is called before begin(), send it the slow way:
+	if(!running){
+		*cs_clear_registers[chip] = 1;
+		SPI.transfer16(command);
+		*cs_set_registers[chip] = 1;
+		return;
+	}
+
+	//heads in OM_CONTROL_IN_TIMER mode write from the control interrupt, which can land in the middle of a write from the main loop.
+	//Masking only the SPI interrupt would let both writers take the same send_order slot, so every interrupt is held off while the queue
+	//is added to. PRIMASK is put back the way it was afterwards instead of just turning interrupts on, so this works inside an interrupt too.
+	uint32_t primask;
+	__asm__ volatile("mrs %0, primask" : "=r" (primask));
+	__disable_irq();
+	pending_commands[chip] = command;
+	if(chip_is_pending[chip]){
+		//only the latest value for a pot matters, so the one that was waiting is replaced:
+		coalesced_commands++;
+	} else {
+		chip_is_pending[chip] = true;
+		send_order[(send_order_start + send_order_count) % PQ_MAX_CHIPS] = chip;
+		send_order_count++;
+	}
+	if(chip_in_flight == PQ_NO_CHIP){
+		start_next();
+	}
+	__asm__ volatile("msr primask, %0" : : "r" (primask) : "memory");
+}
+
+bool PotQueue::is_idle(void)
+{
+	return chip_in_flight == PQ_NO_CHIP && send_order_count == 0;
+}
+
+void PotQueue::flush(void)
+{
+	while(!is_idle()){
+		//the interrupt is doing the work.
+	}
+}
+
+uint32_t PotQueue::coalesced_count(void)
+{
+	return coalesced_commands;
+}
+
+/* ----- END PUBLIC FUNCTIONS ----- */
+/* ----- PRIVATE FUNCTIONS BELOW ----- */
+
+void PotQueue::start_next(void)
+{
+	if(send_order_count == 0){
+		chip_in_flight = PQ_NO_CHIP;
+		return;
+	}
+	uint8_t chip = send_order[send_order_start];
+	send_order_start = (send_order_start + 1) % PQ_MAX_CHIPS;
+	send_order_count--;
+	chip_is_pending[chip] = false;
+	chip_in_flight = chip;
+
+	//select the chip and push the command. The command is in the high byte and the value in the low byte.
+	*cs_clear_registers[chip] = 1;
+	SPI0_PUSHR = pending_commands[chip] | SPI_PUSHR_CTAS(1);
+}
+
+void PotQueue::spi0_isr(void)
+{
+	PotQueue * queue = active_queue;
+	//throw out the byte the pot sent back and clear the flag:
+	(void)SPI0_POPR;
+	SPI0_SR = SPI_SR_RFDF;
+	//de-select the chip that just finished, which latches its new wiper value:
+	if(queue->chip_in_flight != PQ_NO_CHIP){
+		*queue->cs_set_registers[queue->chip_in_flight] = 1;
+	}
+	queue->start_next();
+}
+
+/* ----- END PRIVATE FUNCTIONS ----- */
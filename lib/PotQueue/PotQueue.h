@@ -0,0 +1,119 @@
+/*
+This is a shared queue for writing to the MCP4151 digital pots on all of the
+oMIDItone heads. Each head has two pots, so a chord or a pitch bend across a
+whole channel can mean twelve pot writes at once. Written one after the other
+with blocking SPI, those hold up the main loop while they go out.
+
+Instead, heads put their wiper commands in the queue with write(), which
+returns right away. The queue starts sending as soon as there is something in
+it, and the SPI receive interrupt sends the next command every time one
+finishes, so the commands go out back to back in the background.
+
+The chip select pins for the pots are ordinary GPIO pins, so the DSPI's own
+chip select outputs can't be used to frame each write. The interrupt handles
+the chip selects instead: it raises the select for the command that just
+finished and lowers the select for the next one before pushing it.
+
+If a pot already has a command waiting to go out, a new write() to the same pot
+just replaces the value that will be sent, since only the latest value
+matters. This means each pot is in the queue at most once, so it can never
+fill up.
+
+Copyright 2019 - kiyoshigawa - tim@twa.ninja
+*/
+
+/*
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POT_QUEUE_H
+#define POT_QUEUE_H
+
+#include <Arduino.h>
+
+//The queue uses the SPI library to set up SPI0, then runs it directly from the interrupt.
+#include <SPI.h>
+
+//This is the maximum number of digital pots that can be added. Two per oMIDItone head.
+#define PQ_MAX_CHIPS 12
+
+//This is the SPI clock speed for the MCP4151 digital pots. They are rated for up to 10MHz.
+#define PQ_SPI_CLOCK 10000000
+
+//This is returned by add_chip() if the chip could not be added.
+#define PQ_NO_CHIP 255
+
+class PotQueue {
+	public:
+		//constructor function
+		PotQueue();
+
+		//This will add a pot's chip select pin and return the chip number to use in write().
+		//If the pin has already been added, its existing chip number is returned. Returns PQ_NO_CHIP on failure.
+		uint8_t add_chip(uint8_t cs_pin);
+
+		//This will set up SPI0 and the chip select pins, and start the interrupt. It does nothing if already running.
+		void begin(void);
+
+		//This will queue a 16 bit command for a chip and return right away. If the chip already has a command waiting, it is replaced.
+		//It is safe to call from the main loop and from interrupts at the same time, since heads can be updated from either one.
+		void write(uint8_t chip, uint16_t command);
+
+		//This returns true when there is nothing waiting or being sent.
+		bool is_idle(void);
+
+		//This will wait until everything in the queue has been sent.
+		void flush(void);
+
+		//This returns the number of commands that were replaced by a newer one before they were sent.
+		uint32_t coalesced_count(void);
+
+	private:
+		//This sends the next command in the queue, if there is one. It must be called with the SPI interrupt unable to run.
+		void start_next(void);
+
+		//This is called when the SPI has finished sending a command.
+		static void spi0_isr(void);
+
+		//This is the queue that is currently running, for the SPI interrupt.
+		static PotQueue * active_queue;
+
+		//these are the chip select pins that have been added, in chip order, and the number of them.
+		uint8_t cs_pins[PQ_MAX_CHIPS];
+		uint8_t num_chips;
+
+		//these are the registers that set and clear each chip select pin, for toggling them quickly.
+		volatile uint8_t * cs_set_registers[PQ_MAX_CHIPS];
+		volatile uint8_t * cs_clear_registers[PQ_MAX_CHIPS];
+
+		//this is the command waiting to be sent to each chip, and whether there is one.
+		volatile uint16_t pending_commands[PQ_MAX_CHIPS];
+		volatile bool chip_is_pending[PQ_MAX_CHIPS];
+
+		//this is the order the waiting chips will be sent in. It can hold every chip, so it never overflows.
+		volatile uint8_t send_order[PQ_MAX_CHIPS];
+		volatile uint8_t send_order_start;
+		volatile uint8_t send_order_count;
+
+		//this is the chip whose command is being sent right now, or PQ_NO_CHIP if the SPI is idle.
+		volatile uint8_t chip_in_flight;
+
+		//this counts the commands replaced before they were sent, for coalesced_count()
+		volatile uint32_t coalesced_commands;
+
+		//This is true once begin() has been called.
+		bool running;
+};
+
+#endif
@@ -0,0 +1,107 @@
+/*
+This is the SimulatedPeriodBackend library, which makes up the rising edges of
+a modeled otamatone oscillator.
+
+Copyright 2019 - kiyoshigawa - tim@twa.ninja
+*/
+/*
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <SimulatedPeriodBackend.h>
+
+#ifndef __arm__
+
+SimulatedPeriodBackend::SimulatedPeriodBackend(uint32_t lowest_freq, uint32_t highest_freq, uint32_t jitter_cycles)
+{
+	slowest_freq_hz = lowest_freq;
+	fastest_freq_hz = highest_freq;
+	jitter = jitter_cycles;
+	current_resistance = 0;
+	target_period = model_period(0);
+	current_period = target_period;
+	next_edge_time = 0;
+	simulated_time = 0;
+	random_state = 1;
+}
+
+/* ----- PUBLIC FUNCTIONS BELOW ----- */
+
+void SimulatedPeriodBackend::begin(void)
+{
+	next_edge_time = simulated_time + current_period;
+}
+
+bool SimulatedPeriodBackend::read_edge(uint32_t * edge_time)
+{
+	//the edge hasn't happened yet if it's still in the future:
+	if((int32_t)(simulated_time - next_edge_time) < 0){
+		return false;
+	}
+	*edge_time = next_edge_time;
+
+	//move the period part of the way towards the target, and work out when the next edge will be:
+	int32_t error = (int32_t)target_period - (int32_t)current_period;
+	current_period += error >> PB_SIM_SETTLING_SHIFT;
+	if(error != 0 && (error >> PB_SIM_SETTLING_SHIFT) == 0){
+		current_period = target_period;
+	}
+	next_edge_time += current_period + next_jitter();
+	return true;
+}
+
+uint32_t SimulatedPeriodBackend::current_time(void)
+{
+	return simulated_time;
+}
+
+void SimulatedPeriodBackend::resistance_changed(uint16_t resistance)
+{
+	//this is called every time the resistance is set, so skip the division when it hasn't changed:
+	if(resistance != current_resistance){
+		current_resistance = resistance;
+		target_period = model_period(resistance);
+	}
+}
+
+void SimulatedPeriodBackend::advance(uint32_t cycles)
+{
+	simulated_time += cycles;
+}
+
+uint32_t SimulatedPeriodBackend::model_period(uint16_t resistance)
+{
+	if(resistance > PB_SIM_MAX_RESISTANCE){
+		resistance = PB_SIM_MAX_RESISTANCE;
+	}
+	uint32_t freq_hz = slowest_freq_hz + (fastest_freq_hz - slowest_freq_hz)*resistance/PB_SIM_MAX_RESISTANCE;
+	return PB_SIM_CYCLES_PER_SECOND/freq_hz;
+}
+
+/* ----- END PUBLIC FUNCTIONS ----- */
+/* ----- PRIVATE FUNCTIONS BELOW ----- */
+
+int32_t SimulatedPeriodBackend::next_jitter(void)
+{
+	if(jitter == 0){
+		return 0;
+	}
+	//this is the classic ANSI C linear congruential generator, which is plenty random enough for this:
+	random_state = random_state*1103515245 + 12345;
+	return (int32_t)((random_state >> 16) % (2*jitter + 1)) - (int32_t)jitter;
+}
+
+/* ----- END PRIVATE FUNCTIONS ----- */
+
+#endif
@@ -0,0 +1,113 @@
+/*
+This is a period measurement backend that doesn't need an oMIDItone head at
+all. It makes up rising edges from a simple model of the otamatone oscillator
+so the pitch correction code can be exercised and compared against the real
+backends on a computer.
+
+The model's frequency goes up in a straight line from lowest_freq at a
+resistance of 0 to highest_freq at the top resistance step. When the
+resistance changes, the period doesn't jump straight to the new value, it
+moves a fraction of the way there on every period like the analog circuit
+settling. Every period also gets a random amount of jitter added to it.
+
+The backend keeps its own clock, in the same CPU cycles as the real backends,
+which only moves when advance() is called. A test can run through simulated
+time as fast as it likes, and gets the same edges every time.
+
+It is only built off the Teensy. The firmware never uses it, and the real
+backends are the ones that need the Teensy hardware, so it is left out of the
+firmware build entirely. The host tests in test/ build it with the native
+environment in platformio.ini.
+
+Copyright 2019 - kiyoshigawa - tim@twa.ninja
+*/
+
+/*
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMULATED_PERIOD_BACKEND_H
+#define SIMULATED_PERIOD_BACKEND_H
+
+#ifndef __arm__
+
+#include <PeriodBackend.h>
+
+//This is the number of simulated CPU cycles per second. It matches F_CPU on the Teensy, so the periods are the same as the real backends'.
+#define PB_SIM_CYCLES_PER_SECOND 96000000UL
+
+//This is the highest resistance step the model knows about. It matches OM_NUM_RESISTANCE_STEPS-1.
+#define PB_SIM_MAX_RESISTANCE 767
+
+//These are the default model settings:
+#define PB_SIM_DEFAULT_LOWEST_FREQ 60
+#define PB_SIM_DEFAULT_HIGHEST_FREQ 2000
+#define PB_SIM_DEFAULT_JITTER_CYCLES 200
+
+//This is how quickly the period settles to a new resistance, as a bit shift per period. 2 moves a quarter of the way every period.
+#define PB_SIM_SETTLING_SHIFT 2
+
+class SimulatedPeriodBackend : public PeriodBackend {
+	public:
+		//constructor function
+		//The frequencies are in Hz, and the jitter is the most that any period can be off by, in CPU cycles.
+		SimulatedPeriodBackend(uint32_t lowest_freq = PB_SIM_DEFAULT_LOWEST_FREQ, uint32_t highest_freq = PB_SIM_DEFAULT_HIGHEST_FREQ, uint32_t jitter_cycles = PB_SIM_DEFAULT_JITTER_CYCLES);
+
+		//This starts the first period from the current simulated time.
+		void begin(void);
+
+		//This returns the next edge of the model if the simulated clock has reached it.
+		bool read_edge(uint32_t * edge_time);
+
+		//This returns the simulated clock.
+		uint32_t current_time(void);
+
+		//This sets the resistance the model's period is settling towards.
+		void resistance_changed(uint16_t resistance);
+
+		//This moves the simulated clock forward by a number of CPU cycles.
+		void advance(uint32_t cycles);
+
+		//This returns the period in CPU cycles that the model would settle to at a resistance.
+		uint32_t model_period(uint16_t resistance);
+
+	private:
+		//This returns a random number from -jitter to +jitter. It has its own generator so runs can be repeated.
+		int32_t next_jitter(void);
+
+		//These are the model settings from the constructor.
+		uint32_t slowest_freq_hz;
+		uint32_t fastest_freq_hz;
+		uint32_t jitter;
+
+		//This is the resistance the model was last set to.
+		uint16_t current_resistance;
+
+		//This is the period the model is settling towards, and the period it is at now, in CPU cycles.
+		uint32_t target_period;
+		uint32_t current_period;
+
+		//This is the time of the next edge that hasn't been read yet.
+		uint32_t next_edge_time;
+
+		//This is the simulated clock, in CPU cycles.
+		uint32_t simulated_time;
+
+		//This is the state of the jitter random number generator.
+		uint32_t random_state;
+};
+
+#endif
+
+#endif
@@ -39,27 +39,83 @@ Copyright 2019 - kiyoshigawa - tim@twa.ninja
 
 #include <oMIDItone.h>
 
-oMIDItone::oMIDItone(uint16_t signal_enable_optoisolator, uint16_t speaker_disable_optoisolator, uint16_t cs1, uint16_t cs2, uint16_t feedback, uint16_t servo_l_channel, uint16_t servo_r_channel, uint16_t servo_l_min, uint16_t servo_l_max, uint16_t servo_r_min, uint16_t servo_r_max, uint16_t led_head_array[OM_NUM_LEDS_PER_HEAD], Animation * head_animation)
+oMIDItone::oMIDItone(uint16_t signal_enable_optoisolator, uint16_t speaker_disable_optoisolator, uint16_t cs1, uint16_t cs2, uint16_t feedback, uint16_t servo_l_channel, uint16_t servo_r_channel, uint16_t servo_l_min, uint16_t servo_l_max, uint16_t servo_r_min, uint16_t servo_r_max, uint16_t led_head_array[OM_NUM_LEDS_PER_HEAD], Animation * head_animation, PeriodBackend * period_backend, PotQueue * pot_queue)
 {
 	//Declare default values for variables:
 	had_successful_init = false;
+	calibration_state = OM_CAL_IDLE;
+	calibration_edges = 0;
+	calibration_settle_period = 0;
+	calibration_settled_readings = 0;
+	calibration_mode = OM_CALIBRATION_MODE_DEFAULT;
+	calibration_is_fine_pass = false;
+	calibration_top = OM_NUM_RESISTANCE_STEPS-OM_RESISTANCE_MARGIN;
+	for(int i=0; i<OM_NUM_RESISTANCE_STEPS/8; i++){
+		fine_steps[i] = 0;
+	}
+	calibration_is_verify_pass = false;
+	for(int i=0; i<OM_VERIFY_NUM_POINTS; i++){
+		verify_steps[i] = OM_RESISTANCE_MARGIN;
+		verify_freqs[i] = OM_NO_FREQ;
+	}
+	verify_index = 0;
 	pitch_correction_is_enabled = OM_FREQ_CORRECTION_DEFAULT_ENABLE_STATE;
 	servo_is_enabled = OM_SERVO_DEFAULT_ENABLE_STATE;
-	smallest_freq = 1000000U; //larger than MIDI note 0 by an order of magnitude
+	calibration_learning_is_enabled = OM_CALIBRATION_LEARNING_DEFAULT_ENABLE_STATE;
+	learning_candidate_freq = OM_NO_FREQ;
+	learning_candidate_resistance = 0;
+	calibration_updates = 0;
+	reset_drift_estimate();
+	drift_lock_recorded = false;
+	measurement_mode = OM_MEASUREMENT_MODE_DEFAULT;
+	correction_mode = OM_CORRECTION_MODE_DEFAULT;
+	pi_kp = OM_PI_DEFAULT_KP;
+	pi_ki = OM_PI_DEFAULT_KI;
+	pi_base_resistance = 0;
+	pi_integral = 0;
+	correction_interval = 0;
+	readings_since_correction = 0;
+	smallest_freq = OM_US_TO_PERIOD(1000000U); //larger than MIDI note 0 by an order of magnitude
 	largest_freq = 0;
 	for(int i=0; i<OM_NUM_RESISTANCE_STEPS; i++){
 		measured_freqs[i] = 0;
+		measured_quality[i] = 0;
 	}
-	for(int i=0; i<OM_NUM_FREQ_READINGS; i++){
-		recent_freqs[i] = 0;
+	for(int n=0; n<MIDI_NUM_NOTES; n++){
+		note_resistance_cache[n] = OM_NUM_RESISTANCE_STEPS-OM_RESISTANCE_MARGIN-2;
 	}
-	freq_reading_index = 0;
+	freq_estimator.begin(OM_NUM_FREQ_READINGS, OM_FREQ_ESTIMATOR_MODE, OM_FREQ_ESTIMATOR_TRIM);
+	span_start_time = 0;
+	span_num_periods = 0;
+	span_target_periods = OM_MIN_SPAN_PERIODS;
 	current_freq = OM_NO_FREQ;
 	current_desired_freq = OM_NO_FREQ;
-	last_analog_read = 1024;
+	last_rising_edge_time = 0;
+	previous_rising_edge_time = 0;
+	rising_edge_period = 0;
 	current_resistance = 0;
 	pitch_correction_has_been_compromised = false;
-	new_note_dropped = false;
+	notes_dropped = 0;
+	notes_dropped_seen = 0;
+	dropped_note_freq = OM_NO_FREQ;
+	dropped_note_reason = OM_DROP_BOTTOMED_OUT;
+	notes_dropped_printed = 0;
+	control_mode = OM_CONTROL_MODE_DEFAULT;
+	requested_freq = OM_NO_FREQ;
+	request_sequence = 0;
+	applied_request_sequence = 0;
+	resistance_fraction = 0;
+	dither_accumulator = 0;
+	dither_is_high = false;
+	last_written_resistance = 0xFFFF;
+	last_set_resistance = 0;
+	resistance_is_settling = false;
+	resistance_change_time = 0;
+	settling_periods_left = 0;
+	settling_periods = OM_SETTLING_PERIODS;
+	settling_cycles = OM_SETTLING_TIME*(F_CPU/1000000);
+	settling_rejected_readings = 0;
+	range_rejected_readings = 0;
 
 	//set pin variables based on constructor inputs:
 	signal_enable_optoisolator_pin = signal_enable_optoisolator;
@@ -67,11 +123,8 @@ oMIDItone::oMIDItone(uint16_t signal_enable_optoisolator, uint16_t speaker_disab
 	cs1_pin = cs1;
 	cs2_pin = cs2;
 	analog_feedback_pin = feedback;
-
-	//set up an instanced ADC object for use in the code.
-	ADC *adc = new ADC();
-	//this line makes the unused variable go away, since we never otherwise directly interact with the adc, only the pointer to it.
-	(void)adc;
+	last_pot1_value = OM_POT_UNKNOWN;
+	last_pot2_value = OM_POT_UNKNOWN;
 
 	//Servo channels
 	l_channel = servo_l_channel;
@@ -88,14 +141,29 @@ oMIDItone::oMIDItone(uint16_t signal_enable_optoisolator, uint16_t speaker_disab
 
 	//Set the animation pointer:
 	animation = head_animation;
+
+	//Set the backend pointer. The hardware isn't touched until init().
+	backend = period_backend;
+
+	//Add this head's pots to the shared queue:
+	pots = pot_queue;
+	pot1_chip = pots->add_chip(cs1_pin);
+	pot2_chip = pots->add_chip(cs2_pin);
 }
 
 /* ----- PUBLIC FUNCTIONS BELOW ----- */
 
-void oMIDItone::init(void)
+void oMIDItone::init(bool use_stored_calibration)
+{
+	start_init(use_stored_calibration);
+	while(update_init()){
+		//the startup test is running.
+	}
+}
+
+void oMIDItone::start_init(bool use_stored_calibration)
 {
 	//start timers.
-	last_rising_edge = 0;
 	last_servo_update = 0;
 
 	//enable servo outputs:
@@ -126,11 +194,11 @@ void oMIDItone::init(void)
 	pinMode(speaker_disable_optoisolator_pin, OUTPUT);
 	pinMode(analog_feedback_pin, INPUT);
 
-	//set up ADC:
-	adc->setAveraging(0);
-	adc->setResolution(8);
-	adc->setConversionSpeed(ADC_CONVERSION_SPEED::HIGH_SPEED);
-	adc->setSamplingSpeed(ADC_SAMPLING_SPEED::VERY_HIGH_SPEED);
+	//start finding rising edges on the feedback pin:
+	backend->begin();
+
+	//the table is about to be measured from scratch, so any old drift doesn't apply to it:
+	reset_drift_estimate();
 
 	//turn off relay and all CS pins
 	digitalWrite(cs1_pin, HIGH);
@@ -138,25 +206,54 @@ void oMIDItone::init(void)
 	digitalWrite(signal_enable_optoisolator_pin, LOW);
 	digitalWrite(speaker_disable_optoisolator_pin, HIGH); //defaults to the speakers being enabled. The startup test will disable them, and then re-enable them when complete.
 
-	//init SPI
-	SPI.begin();
+	//start the shared pot queue, which sets up SPI. Only the first head to get here actually starts it.
+	pots->begin();
+	//the pots could be set to anything at power up, so make sure the first write to each one goes through:
+	last_pot1_value = OM_POT_UNKNOWN;
+	last_pot2_value = OM_POT_UNKNOWN;
+	last_written_resistance = 0xFFFF;
+
+	//if this head was tested before, check what it measured then instead of measuring everything again:
+	if(use_stored_calibration && load_calibration()){
+		start_verification();
+		return;
+	}
 
-	//Play startup tone and save initial resistance to note values.
-	bool startup_succeeded = startup_test();
-	if(!startup_succeeded){
+	//Play startup tone and save initial resistance to note values. update_init() does the rest.
+	start_startup_test();
+}
+
+bool oMIDItone::update_init(void)
+{
+	if(startup_test_update()){
+		return true;
+	}
+	if(calibration_state == OM_CAL_FAILED){
 		#ifdef OM_DEBUG
 			Serial.print("Init for oMIDItone on relay pin ");
 			Serial.print(signal_enable_optoisolator_pin);
 			Serial.println(" failed.");
 		#endif
+		//only print it once:
+		calibration_state = OM_CAL_IDLE;
 	}
+	return false;
 }
 
 void oMIDItone::update(void)
 {
+	#ifdef OM_DEBUG
+		print_dropped_note();
+	#endif
+
 	//if no note is set, disable the relay and stop checking the current frequency.
 	//don't bother with any of the rest if the head can't play the current_note
-	if(!can_play_freq(current_desired_freq)){
+	//the control interrupt can drop the note or change the range while this is checked, so it's checked with interrupts off.
+	//a note that is still in the mailbox counts, so the relay isn't turned back on right after sound_off():
+	noInterrupts();
+	bool is_playable = can_play_period(latest_desired_freq());
+	interrupts();
+	if(!is_playable){
 		//turn off the noise.
 		digitalWrite(signal_enable_optoisolator_pin, LOW);
 	} else {
@@ -164,12 +261,10 @@ void oMIDItone::update(void)
 		if(note_start_time > OM_NOTE_WAIT_TIME){
 			digitalWrite(signal_enable_optoisolator_pin, HIGH);
 		}
-		//continuously measure the current frequency and adjust the resistance as needed.
-		if(pitch_correction_is_enabled){
-			measure_freq();
+		//in OM_CONTROL_IN_TIMER mode, control_update() is taking care of the rest.
+		if(control_mode == OM_CONTROL_IN_LOOP){
+			correction_update();
 		}
-		//and set the resistance to a jittered value based on the adjusted current_resistance.
-		set_jitter_resistance(current_resistance, OM_JITTER);
 	}
 
 	//Update servos at the specified animation update rate:
@@ -184,14 +279,42 @@ void oMIDItone::update(void)
 	}
 }
 
+void oMIDItone::control_update(void)
+{
+	if(control_mode != OM_CONTROL_IN_TIMER){
+		return;
+	}
+	//pick up a new note from the mailbox:
+	uint32_t sequence = request_sequence;
+	if(sequence != applied_request_sequence){
+		applied_request_sequence = sequence;
+		om_period_t freq = requested_freq;
+		if(freq == OM_NO_FREQ){
+			current_desired_freq = OM_NO_FREQ;
+		} else {
+			set_freq(freq);
+		}
+	}
+	if(can_play_period(current_desired_freq)){
+		correction_update();
+	}
+}
+
+void oMIDItone::set_control_mode(uint8_t mode)
+{
+	control_mode = mode;
+	//anything in the mailbox has already been played directly:
+	applied_request_sequence = request_sequence;
+}
+
 bool oMIDItone::play_freq(uint32_t freq)
 {
 	if(can_play_freq(freq)){
 		note_start_time = 0;
-		set_freq(freq);
+		request_freq(OM_US_TO_PERIOD(freq));
 		return true;
 	} else{
-		current_desired_freq = OM_NO_FREQ;
+		request_freq(OM_NO_FREQ);
 		return false;
 	}
 }
@@ -199,16 +322,16 @@ bool oMIDItone::play_freq(uint32_t freq)
 bool oMIDItone::update_freq(uint32_t freq)
 {
 	if(can_play_freq(freq)){
-		set_freq(freq);
+		request_freq(OM_US_TO_PERIOD(freq));
 		return true;
 	} else {
-		current_desired_freq = OM_NO_FREQ;
+		request_freq(OM_NO_FREQ);
 		return false;
 	}
 }
 void oMIDItone::sound_off(void)
 {
-	current_desired_freq = OM_NO_FREQ;
+	request_freq(OM_NO_FREQ);
 	digitalWrite(signal_enable_optoisolator_pin, LOW);
 }
 
@@ -228,7 +351,11 @@ void oMIDItone::cancel_pitch_correction(void)
 
 bool oMIDItone::is_ready(void)
 {
-	if(had_successful_init && current_desired_freq == OM_NO_FREQ){
+	//a note that is still in the mailbox counts as playing, so a pitch bend right after play_freq() isn't missed:
+	noInterrupts();
+	om_period_t desired_freq = latest_desired_freq();
+	interrupts();
+	if(had_successful_init && desired_freq == OM_NO_FREQ){
 		return true;
 	} else {
 		return false;
@@ -256,19 +383,118 @@ void oMIDItone::disable_servos(void)
 	servo_is_enabled = false;
 }
 
+void oMIDItone::enable_calibration_learning(void)
+{
+	calibration_learning_is_enabled = true;
+}
+
+void oMIDItone::disable_calibration_learning(void)
+{
+	calibration_learning_is_enabled = false;
+}
+
+uint32_t oMIDItone::calibration_update_count(void)
+{
+	return calibration_updates;
+}
+
+void oMIDItone::reset_drift_estimate(void)
+{
+	//the control interrupt uses the drift estimate, so don't let it see half of one:
+	noInterrupts();
+	drift_scale = 1L << OM_DRIFT_SCALE_FRAC_BITS;
+	drift_offset = 0;
+	drift_mean_table = 0;
+	drift_mean_live = 0;
+	drift_variance = 0;
+	drift_covariance = 0;
+	drift_num_locks = 0;
+	interrupts();
+}
+
+void oMIDItone::set_correction_mode(uint8_t mode)
+{
+	//the control interrupt can be moving the resistance, so the mode and starting point are changed together with interrupts off:
+	noInterrupts();
+	correction_mode = mode;
+	//start the controller fresh from wherever the resistance is now:
+	pi_base_resistance = (current_resistance << OM_DITHER_FRAC_BITS) | resistance_fraction;
+	pi_integral = 0;
+	interrupts();
+}
+
+void oMIDItone::set_calibration_slot(uint8_t slot)
+{
+	//the relay pin is different for every head, so it's used to tell whose results are in a slot:
+	calibration_store.begin(slot, signal_enable_optoisolator_pin);
+}
+
+void oMIDItone::set_calibration_mode(uint8_t mode)
+{
+	calibration_mode = mode;
+}
+
+void oMIDItone::set_pi_gains(int16_t kp, int16_t ki)
+{
+	noInterrupts();
+	pi_kp = kp;
+	pi_ki = ki;
+	interrupts();
+}
+
+void oMIDItone::set_edge_timing(uint8_t mode)
+{
+	backend->set_edge_timing(mode);
+	pitch_correction_has_been_compromised = true;
+}
+
+void oMIDItone::set_measurement_mode(uint8_t mode)
+{
+	noInterrupts();
+	measurement_mode = mode;
+	freq_estimator.reset();
+	pitch_correction_has_been_compromised = true;
+	interrupts();
+}
+
 bool oMIDItone::note_was_dropped(void){
-	if(new_note_dropped){
-		new_note_dropped = false;
+	uint32_t dropped = notes_dropped;
+	if(dropped != notes_dropped_seen){
+		notes_dropped_seen = dropped;
 		return true;
 	} else {
 		return false;
 	}
 }
 
+void oMIDItone::set_settling_window(uint8_t periods, uint32_t time)
+{
+	settling_periods = periods;
+	settling_cycles = time*(F_CPU/1000000);
+}
+
+uint8_t oMIDItone::step_quality(uint16_t resistance)
+{
+	if(resistance >= OM_NUM_RESISTANCE_STEPS){
+		return OM_STEP_NOT_MEASURED;
+	}
+	return measured_quality[resistance];
+}
+
+uint32_t oMIDItone::settling_rejected_count(void)
+{
+	return settling_rejected_readings;
+}
+
+uint32_t oMIDItone::range_rejected_count(void)
+{
+	return range_rejected_readings;
+}
+
 /* ----- END PUBLIC FUNCTIONS ----- */
 /* ----- PRIVATE FUNCTIONS BELOW ----- */
 
-bool oMIDItone::startup_test(void)
+void oMIDItone::start_startup_test(void)
 {
 
 	//the first part is all manual control of the resistance value and the signal_enable_optoisolator_pin.
@@ -286,102 +512,219 @@ bool oMIDItone::startup_test(void)
 	//Start counting microseconds since a rising edge to calculate frequencies:
 	last_stabilize_time = 0;
 
-	//run a stabilization note for a minute.
-	while(last_stabilize_time < OM_TIME_TO_WAIT_FOR_STARTUP_TEST_SOUND){
-		set_jitter_resistance(OM_JITTER, OM_JITTER);
+	//every step starts out unmeasured, so the coarse pass knows which ones it has filled in:
+	calibration_top = OM_NUM_RESISTANCE_STEPS-OM_RESISTANCE_MARGIN;
+	calibration_is_fine_pass = false;
+	calibration_is_verify_pass = false;
+	for(int i=0; i<OM_NUM_RESISTANCE_STEPS; i++){
+		measured_quality[i] = OM_STEP_NOT_MEASURED;
 	}
+	//the playable range comes from this test only, not from stored results or an earlier test:
+	had_successful_init = false;
+	smallest_freq = OM_US_TO_PERIOD(1000000U);
+	largest_freq = 0;
+	//a failed verification can leave its fit in the drift estimate, and the new table is measured as it is now:
+	reset_drift_estimate();
 
-	//Confirm the first rising edge before the timeout to make sure we are getting good data.
-	last_rising_edge = 0;
-	elapsedMillis startup_start_time = 0;
+	//run a stabilization note for a bit before looking for rising edges.
+	set_dithered_resistance(OM_RESISTANCE_MARGIN, 0);
+	calibration_state = OM_CAL_STABILIZING;
+}
 
-	while(1){
-		if(is_rising_edge()){
-			last_rising_edge = 0;
-			last_freq_measurement = 0;
-			break;
-		}
-		//If it doesn't detect a first rising edge in time, return false so the rest of the controller can continue to function.
-		if(startup_start_time > OM_TIME_TO_WAIT_FOR_INIT){
-			digitalWrite(signal_enable_optoisolator_pin, LOW);
-			current_freq = OM_NO_FREQ;
-			return false;
-		}
-	}
+bool oMIDItone::startup_test_update(void)
+{
+	switch(calibration_state){
+		case OM_CAL_STABILIZING:
+			set_dithered_resistance(OM_RESISTANCE_MARGIN, 0);
+			if(last_stabilize_time >= OM_TIME_TO_WAIT_FOR_STARTUP_TEST_SOUND){
+				//Confirm the first rising edge before the timeout to make sure we are getting good data.
+				startup_start_time = 0;
+				calibration_state = OM_CAL_WAITING_FOR_FIRST_EDGE;
+			}
+			return true;
 
-	startup_start_time = 0;
-	//iterate through all frequencies with jitter to determine the average frequency for that resistance.
-	for(uint16_t resistance = OM_JITTER; resistance <= OM_NUM_RESISTANCE_STEPS-OM_JITTER; resistance++){
-		current_resistance = resistance;
-		set_jitter_resistance(current_resistance, OM_JITTER);
-
-		//measure the frequency OM_NUM_FREQ_READINGS times:
-		//wait for OM_NUM_FREQ_READINGS*OM_INIT_MULTIPLIER rising edge before beginning:
-		int num_rising_edges = 0;
-		while(num_rising_edges < OM_NUM_FREQ_READINGS*OM_INIT_MULTIPLIER){
+		case OM_CAL_WAITING_FOR_FIRST_EDGE:
 			if(is_rising_edge()){
-				num_rising_edges++;
-				last_rising_edge = 0;
-			}
-			//If it doesn't detect a rising edge in time mid frequency checking, set the value to the previous value and continue.
-			if(startup_start_time > OM_TIME_TO_WAIT_FOR_INIT){
-				measured_freqs[current_resistance] = measured_freqs[current_resistance-1];
-				break;
+				last_freq_measurement = 0;
+				//iterate through all frequencies to determine the average frequency for that resistance.
+				start_startup_test_step(OM_RESISTANCE_MARGIN);
+			} else if(startup_start_time > OM_TIME_TO_WAIT_FOR_INIT){
+				//If it doesn't detect a first rising edge in time, fail so the rest of the controller can continue to function.
+				digitalWrite(signal_enable_optoisolator_pin, LOW);
+				current_freq = OM_NO_FREQ;
+				calibration_state = OM_CAL_FAILED;
+				return false;
 			}
-		}
-		freq_reading_index = 0;
-		while(1){
-			set_jitter_resistance(current_resistance, OM_JITTER);
-			if(is_rising_edge()){
-				recent_freqs[freq_reading_index] = last_rising_edge;
-				last_rising_edge = 0;
-				freq_reading_index++;
+			return true;
+
+		case OM_CAL_WARMING_UP:
+			//wait until the step has settled, or for OM_NUM_FREQ_READINGS*OM_INIT_MULTIPLIER rising edges at most, before beginning:
+			while(calibration_edges < OM_NUM_FREQ_READINGS*OM_INIT_MULTIPLIER && calibration_settled_readings < OM_CALIBRATION_SETTLED_READINGS && is_rising_edge()){
+				calibration_edges++;
+				//the edges right after the resistance changed say nothing about whether it has settled:
+				if(is_settling()){
+					calibration_settled_readings = 0;
+					continue;
+				}
+				//count the times in a row that agree with the first one. If one doesn't, start a new run from it:
+				om_period_t difference = (rising_edge_period > calibration_settle_period) ? rising_edge_period - calibration_settle_period : calibration_settle_period - rising_edge_period;
+				if(calibration_settled_readings > 0 && difference*1000 <= calibration_settle_period*OM_CALIBRATION_SETTLED_TOLERANCE){
+					calibration_settled_readings++;
+				} else {
+					calibration_settle_period = rising_edge_period;
+					calibration_settled_readings = 1;
+				}
 			}
-			if(freq_reading_index >= OM_NUM_FREQ_READINGS){
-				measured_freqs[current_resistance] = average(recent_freqs, OM_NUM_FREQ_READINGS);
-				//This will break out of the for loop if the measured frequency is higher than OM_SMALLEST_VIABLE_FREQ (less us)
-				if(measured_freqs[current_resistance] < OM_SMALLEST_VIABLE_FREQ){
-					//Set resistance to a failure condition to stop iterating through the for loop.
-					resistance = OM_NUM_RESISTANCE_STEPS;
-					//fill in the rest of the array with the OM_SMALLEST_VIABLE_FREQ to keep the rest of the code working.
-					for(int i=resistance; i<OM_NUM_RESISTANCE_STEPS-OM_JITTER; i++){
-						measured_freqs[current_resistance] = OM_SMALLEST_VIABLE_FREQ;
-					}
+			if(calibration_edges >= OM_NUM_FREQ_READINGS*OM_INIT_MULTIPLIER || calibration_settled_readings >= OM_CALIBRATION_SETTLED_READINGS){
+				freq_estimator.reset();
+				calibration_state = OM_CAL_MEASURING;
+			} else if(startup_start_time > OM_TIME_TO_WAIT_FOR_INIT){
+				//If it doesn't detect a rising edge in time mid frequency checking, set the value to the previous value and continue.
+				//The loaded table is left alone while it is being checked.
+				if(!calibration_is_verify_pass){
+					measured_freqs[current_resistance] = measured_freqs[previous_measured_step(current_resistance)];
 				}
+				freq_estimator.reset();
+				calibration_state = OM_CAL_MEASURING;
+			}
+			return true;
 
-				//This is a check to see if the frequency is unreasonably large, and should be thrown out.
-				if(current_resistance > 5){ //skip the first few, as there's nothing to compare it to.
-					if(measured_freqs[current_resistance] > OM_UNREASONABLY_LARGE_MULTIPLIER*measured_freqs[current_resistance-1]){
-						measured_freqs[current_resistance] = measured_freqs[current_resistance-1];
-					}
+		case OM_CAL_MEASURING:
+			//measure the frequency OM_NUM_FREQ_READINGS times:
+			set_dithered_resistance(current_resistance, 0);
+			while(!freq_estimator.is_full() && is_rising_edge()){
+				//a warm-up that timed out can leave the step still settling, and those periods would pull the measurement off:
+				if(is_settling()){
+					continue;
 				}
-
-				#ifdef OM_STARTUP_PITCH_MEASUREMENT_DEBUG
-					Serial.print("Res->Freq::");
-					Serial.print(current_resistance);
-					Serial.print("->");
-					Serial.println(measured_freqs[current_resistance]);
-				#endif
-
+				freq_estimator.add(rising_edge_period);
+			}
+			if(freq_estimator.is_full() && calibration_is_verify_pass){
+				verify_freqs[verify_index] = freq_estimator.estimate();
+				last_freq_measurement = 0;
+				next_verification_step();
+			} else if(freq_estimator.is_full()){
+				bool keep_going = save_startup_test_step();
 				//reset the timeout when a new frequency measurement has occurred.
 				last_freq_measurement = 0;
-				break; //break the while loop for this specific resistance value
-			}
-			//If it doesn't detect a rising edge in time mid frequency checking, set the value to the previous value and continue.
-			if(last_freq_measurement > OM_NOTE_TIMEOUT || last_rising_edge > OM_NOTE_TIMEOUT*1000){
-				measured_freqs[current_resistance] = measured_freqs[current_resistance-1];
+				if(!keep_going){
+					//the rest of the steps have been filled in, so this is the last one to measure:
+					calibration_top = current_resistance;
+				}
+				next_startup_test_step();
+			} else if((last_freq_measurement > OM_NOTE_TIMEOUT || time_since_rising_edge() > OM_NOTE_TIMEOUT*(F_CPU/1000)) && calibration_is_verify_pass){
+				//a reference step that can't be measured can't vouch for the table:
+				verify_freqs[verify_index] = OM_NO_FREQ;
+				last_freq_measurement = 0;
+				next_verification_step();
+			} else if(last_freq_measurement > OM_NOTE_TIMEOUT || time_since_rising_edge() > OM_NOTE_TIMEOUT*(F_CPU/1000)){
+				//If it doesn't detect a rising edge in time mid frequency checking, set the value to the previous value and continue.
+				measured_freqs[current_resistance] = measured_freqs[previous_measured_step(current_resistance)];
+				measured_quality[current_resistance] = OM_STEP_TIMED_OUT;
 				//reset the timeout counter when breaking a loop for timeout.
 				last_freq_measurement = 0;
-				break; //break the while loop for this specific resistance value
+				next_startup_test_step();
 			}
-		} //while (1)
-	} //for resistance step loop
+			return calibration_state != OM_CAL_DONE && calibration_state != OM_CAL_FAILED;
+
+		default:
+			return false;
+	}
+}
+
+void oMIDItone::start_startup_test_step(uint16_t resistance)
+{
+	current_resistance = resistance;
+	set_dithered_resistance(current_resistance, 0);
+	measured_quality[current_resistance] = 0;
+	calibration_edges = 0;
+	calibration_settled_readings = 0;
+	//every step gets the full OM_TIME_TO_WAIT_FOR_INIT to warm up in:
+	startup_start_time = 0;
+	calibration_state = OM_CAL_WARMING_UP;
+}
+
+bool oMIDItone::save_startup_test_step(void)
+{
+	bool keep_going = true;
+	measured_freqs[current_resistance] = freq_estimator.estimate();
+	//save how far apart the readings were, as a percent of the frequency:
+	uint32_t spread = (freq_estimator.highest() - freq_estimator.lowest())*100/measured_freqs[current_resistance];
+	if(spread > OM_STEP_SPREAD_MASK){
+		spread = OM_STEP_SPREAD_MASK;
+	}
+	measured_quality[current_resistance] = spread;
+	//This will stop the test after this step if the measured frequency is higher than OM_SMALLEST_VIABLE_FREQ (less us)
+	if(measured_freqs[current_resistance] < OM_US_TO_PERIOD(OM_SMALLEST_VIABLE_FREQ)){
+		keep_going = false;
+		//fill in the rest of the array with the OM_SMALLEST_VIABLE_FREQ to keep the rest of the code working.
+		for(int i=current_resistance+1; i<=OM_NUM_RESISTANCE_STEPS-OM_RESISTANCE_MARGIN; i++){
+			measured_freqs[i] = OM_US_TO_PERIOD(OM_SMALLEST_VIABLE_FREQ);
+			measured_quality[i] = OM_STEP_NOT_MEASURED;
+		}
+	}
+
+	//This is a check to see if the frequency is unreasonably large, and should be thrown out.
+	if(current_resistance > 5){ //skip the first few, as there's nothing to compare it to.
+		uint16_t previous_step = previous_measured_step(current_resistance);
+		if(measured_freqs[current_resistance] > OM_UNREASONABLY_LARGE_MULTIPLIER*measured_freqs[previous_step]){
+			measured_freqs[current_resistance] = measured_freqs[previous_step];
+			measured_quality[current_resistance] |= OM_STEP_SUBSTITUTED;
+		}
+	}
+
+	#ifdef OM_STARTUP_PITCH_MEASUREMENT_DEBUG
+		Serial.print("Res->Freq::");
+		Serial.print(current_resistance);
+		Serial.print("->");
+		Serial.print(OM_PERIOD_TO_US(measured_freqs[current_resistance]));
+		Serial.print(" Quality:");
+		Serial.println(measured_quality[current_resistance], HEX);
+	#endif
+	return keep_going;
+}
+
+void oMIDItone::next_startup_test_step(void)
+{
+	uint16_t next_step = current_resistance+1;
+	if(calibration_is_fine_pass){
+		next_step = next_fine_step(current_resistance+1);
+	} else if(calibration_mode == OM_CALIBRATION_COARSE_TO_FINE){
+		if(current_resistance >= calibration_top){
+			//the coarse pass is done, so go back for the steps that need a closer look:
+			plan_fine_steps();
+			calibration_is_fine_pass = true;
+			next_step = next_fine_step(OM_RESISTANCE_MARGIN);
+		} else {
+			//always finish the coarse pass on the top step, so there's something to interpolate to:
+			next_step = current_resistance + OM_CALIBRATION_COARSE_STEP;
+			if(next_step > calibration_top){
+				next_step = calibration_top;
+			}
+		}
+	}
+	if(next_step > calibration_top){
+		finish_startup_test();
+	} else {
+		start_startup_test_step(next_step);
+	}
+}
+
+void oMIDItone::finish_startup_test(void)
+{
 	digitalWrite(signal_enable_optoisolator_pin, LOW);
 
 	//End manual control of the signal_enable_optoisolator_pin and resistance number - from here on in, use note_on() and note_off()
 
+	//fill in anything that was skipped by OM_CALIBRATION_COARSE_TO_FINE:
+	interpolate_unmeasured_steps(true);
+
+	//keep the table in order so it can be binary searched, and cache where each note starts:
+	make_measured_freqs_monotonic();
+	rebuild_note_cache();
+
 	//Set the max_note and min_note variables based on the frequencies measured:
-	for(uint16_t i = OM_JITTER; i <= OM_NUM_RESISTANCE_STEPS-OM_JITTER; i++){
+	for(uint16_t i = OM_RESISTANCE_MARGIN; i <= OM_NUM_RESISTANCE_STEPS-OM_RESISTANCE_MARGIN; i++){
 		if(measured_freqs[i] > largest_freq){
 			largest_freq = measured_freqs[i];
 		}
@@ -391,9 +734,9 @@ bool oMIDItone::startup_test(void)
 	}
 	#ifdef OM_DEBUG
 		Serial.print("Min Measured Freq in us: ");
-		Serial.println(smallest_freq);
+		Serial.println(OM_PERIOD_TO_US(smallest_freq));
 		Serial.print("Max Measured Freq in us: ");
-		Serial.println(largest_freq);
+		Serial.println(OM_PERIOD_TO_US(largest_freq));
 	#endif
 
 	//if it makes it here the init was successful, and the allowable frequency range is established
@@ -401,7 +744,17 @@ bool oMIDItone::startup_test(void)
 		had_successful_init = true;
 	} else {
 		//only continue when the min and max note values make sense.
-		return false;
+		calibration_state = OM_CAL_FAILED;
+		return;
+	}
+
+	//save the results so the next power up doesn't have to measure them again:
+	if(calibration_store.has_slot()){
+		if(!calibration_store.save(measured_freqs, OM_NUM_RESISTANCE_STEPS, smallest_freq, largest_freq)){
+			#ifdef OM_DEBUG
+				Serial.println("Could not save the startup test results.");
+			#endif
+		}
 	}
 
 	//This will only happen if nothing went wrong above and the oMIDItone is ready for use.
@@ -410,142 +763,687 @@ bool oMIDItone::startup_test(void)
 	#ifdef OM_DEBUG
 		Serial.println("Startup test was successful!");
 	#endif
-	//and finally return true.
+	calibration_state = OM_CAL_DONE;
+}
+
+bool oMIDItone::load_calibration(void)
+{
+	if(!calibration_store.has_slot()){
+		return false;
+	}
+	om_period_t stored_smallest_freq;
+	om_period_t stored_largest_freq;
+	if(!calibration_store.load(measured_freqs, OM_NUM_RESISTANCE_STEPS, &stored_smallest_freq, &stored_largest_freq) || stored_smallest_freq > stored_largest_freq){
+		#ifdef OM_DEBUG
+			Serial.print("No stored startup test results for oMIDItone on relay pin ");
+			Serial.print(signal_enable_optoisolator_pin);
+			Serial.println(".");
+		#endif
+		//the table might have been partly overwritten, so it needs to be measured again:
+		had_successful_init = false;
+		return false;
+	}
+	smallest_freq = stored_smallest_freq;
+	largest_freq = stored_largest_freq;
+
+	//the quality of each step isn't stored, so the steps are all treated as stable. The table was already cleaned up before it was saved.
+	for(int i=0; i<OM_NUM_RESISTANCE_STEPS; i++){
+		measured_quality[i] = 0;
+	}
+	//the steps above the last one that could be measured were all filled in with the smallest frequency:
+	calibration_top = first_step_below(smallest_freq+1, OM_RESISTANCE_MARGIN, OM_NUM_RESISTANCE_STEPS-OM_RESISTANCE_MARGIN);
+	calibration_is_fine_pass = false;
+	rebuild_note_cache();
+	#ifdef OM_DEBUG
+		Serial.print("Loaded stored startup test results for oMIDItone on relay pin ");
+		Serial.print(signal_enable_optoisolator_pin);
+		Serial.println(".");
+	#endif
 	return true;
 }
 
-void oMIDItone::set_freq(uint32_t freq)
+void oMIDItone::start_verification(void)
+{
+	//spread the reference steps evenly from the bottom of the table to the top. The first one has to be OM_RESISTANCE_MARGIN,
+	//since that's where the stabilization note is played:
+	for(int i=0; i<OM_VERIFY_NUM_POINTS; i++){
+		verify_steps[i] = OM_RESISTANCE_MARGIN + (uint32_t)(calibration_top - OM_RESISTANCE_MARGIN)*i/(OM_VERIFY_NUM_POINTS-1);
+		verify_freqs[i] = OM_NO_FREQ;
+	}
+	verify_index = 0;
+	calibration_is_verify_pass = true;
+
+	//the rest is the same as the start of the startup test:
+	digitalWrite(signal_enable_optoisolator_pin, HIGH);
+	digitalWrite(speaker_disable_optoisolator_pin, LOW);
+	last_stabilize_time = 0;
+	set_dithered_resistance(OM_RESISTANCE_MARGIN, 0);
+	calibration_state = OM_CAL_STABILIZING;
+}
+
+void oMIDItone::next_verification_step(void)
+{
+	verify_index++;
+	if(verify_index < OM_VERIFY_NUM_POINTS){
+		start_startup_test_step(verify_steps[verify_index]);
+	} else {
+		finish_verification();
+	}
+}
+
+void oMIDItone::finish_verification(void)
+{
+	calibration_is_verify_pass = false;
+
+	//find the reference step furthest from the table, in 1/1000ths:
+	uint32_t worst_error = 0;
+	for(int i=0; i<OM_VERIFY_NUM_POINTS; i++){
+		om_period_t table = measured_freqs[verify_steps[i]];
+		om_period_t live = verify_freqs[i];
+		if(live == OM_NO_FREQ){
+			worst_error = OM_VERIFY_MAX_ERROR+1;
+			break;
+		}
+		uint32_t error = (uint64_t)((live > table) ? live - table : table - live)*1000/table;
+		if(error > worst_error){
+			worst_error = error;
+		}
+	}
+	#ifdef OM_DEBUG
+		Serial.print("Stored startup test results are off by up to ");
+		Serial.print(worst_error);
+		Serial.println("/1000.");
+	#endif
+
+	//the common case is that nothing has changed, and the head is ready to use right away:
+	if(worst_error <= OM_VERIFY_ALLOWABLE_ERROR){
+		digitalWrite(signal_enable_optoisolator_pin, LOW);
+		had_successful_init = true;
+		digitalWrite(speaker_disable_optoisolator_pin, HIGH);
+		#ifdef OM_DEBUG
+			Serial.println("Stored startup test results were confirmed!");
+		#endif
+		calibration_state = OM_CAL_DONE;
+		return;
+	}
+
+	//a table that is way off isn't worth fixing:
+	if(worst_error > OM_VERIFY_MAX_ERROR || !fit_verification_points()){
+		#ifdef OM_DEBUG
+			Serial.println("Stored startup test results can't be used, running the full startup test.");
+		#endif
+		start_startup_test();
+		return;
+	}
+
+	//find the reference steps that the fit doesn't account for:
+	bool point_is_bad[OM_VERIFY_NUM_POINTS];
+	uint8_t num_bad_points = 0;
+	for(int i=0; i<OM_VERIFY_NUM_POINTS; i++){
+		om_period_t fitted = table_to_live_freq(measured_freqs[verify_steps[i]]);
+		om_period_t live = verify_freqs[i];
+		uint64_t error = (live > fitted) ? live - fitted : fitted - live;
+		point_is_bad[i] = error*1000 > (uint64_t)live*OM_VERIFY_ALLOWABLE_ERROR;
+		if(point_is_bad[i]){
+			num_bad_points++;
+		}
+	}
+	if(num_bad_points > OM_VERIFY_MAX_BAD_POINTS){
+		#ifdef OM_DEBUG
+			Serial.println("Stored startup test results can't be used, running the full startup test.");
+		#endif
+		start_startup_test();
+		return;
+	}
+
+	//the table has shifted as a whole, so correct all of it with the fit. A positive scale keeps it in order.
+	for(int i=0; i<OM_NUM_RESISTANCE_STEPS; i++){
+		measured_freqs[i] = table_to_live_freq(measured_freqs[i]);
+	}
+	reset_drift_estimate();
+	//finish_startup_test() works the range out again from the corrected table:
+	smallest_freq = OM_US_TO_PERIOD(1000000U);
+	largest_freq = 0;
+
+	if(num_bad_points == 0){
+		#ifdef OM_DEBUG
+			Serial.println("Stored startup test results were corrected.");
+		#endif
+		finish_startup_test();
+		return;
+	}
+
+	//measure everything between the good reference steps on either side of each bad one again, using the fine pass:
+	for(int i=0; i<OM_NUM_RESISTANCE_STEPS/8; i++){
+		fine_steps[i] = 0;
+	}
+	for(int i=0; i<OM_VERIFY_NUM_POINTS; i++){
+		if(!point_is_bad[i]){
+			continue;
+		}
+		uint16_t first = (i > 0) ? verify_steps[i-1]+1 : OM_RESISTANCE_MARGIN;
+		uint16_t last = (i < OM_VERIFY_NUM_POINTS-1) ? verify_steps[i+1]-1 : calibration_top;
+		for(uint16_t step=first; step<=last; step++){
+			measured_quality[step] = OM_STEP_NOT_MEASURED;
+		}
+		mark_fine_steps(first, last);
+	}
+	#ifdef OM_DEBUG
+		Serial.print("Stored startup test results were corrected, measuring again around ");
+		Serial.print(num_bad_points);
+		Serial.println(" reference steps.");
+	#endif
+	calibration_is_fine_pass = true;
+	start_startup_test_step(next_fine_step(OM_RESISTANCE_MARGIN));
+}
+
+bool oMIDItone::fit_verification_points(void)
+{
+	//this is a least squares fit, done about the means of the points so the sums stay small enough:
+	int64_t mean_table = 0;
+	int64_t mean_live = 0;
+	for(int i=0; i<OM_VERIFY_NUM_POINTS; i++){
+		mean_table += measured_freqs[verify_steps[i]];
+		mean_live += verify_freqs[i];
+	}
+	mean_table /= OM_VERIFY_NUM_POINTS;
+	mean_live /= OM_VERIFY_NUM_POINTS;
+	int64_t variance = 0;
+	int64_t covariance = 0;
+	for(int i=0; i<OM_VERIFY_NUM_POINTS; i++){
+		int64_t table = (int64_t)measured_freqs[verify_steps[i]] - mean_table;
+		int64_t live = (int64_t)verify_freqs[i] - mean_live;
+		variance += table*table;
+		covariance += table*live;
+	}
+	if(variance == 0 || covariance <= 0){
+		return false;
+	}
+	drift_scale = (covariance << OM_DRIFT_SCALE_FRAC_BITS)/variance;
+	drift_offset = mean_live - ((mean_table*drift_scale) >> OM_DRIFT_SCALE_FRAC_BITS);
+	return drift_scale > 0;
+}
+
+uint16_t oMIDItone::previous_measured_step(uint16_t resistance)
+{
+	for(int i=resistance-1; i>0; i--){
+		if(!(measured_quality[i] & OM_STEP_NOT_MEASURED)){
+			return i;
+		}
+	}
+	return 0;
+}
+
+void oMIDItone::interpolate_unmeasured_steps(bool is_final)
+{
+	uint16_t low_step = OM_RESISTANCE_MARGIN;
+	for(uint16_t high_step = OM_RESISTANCE_MARGIN+1; high_step <= calibration_top; high_step++){
+		if(measured_quality[high_step] & OM_STEP_NOT_MEASURED){
+			continue;
+		}
+		//draw a straight line between the measured steps on either side of the gap:
+		int32_t low_freq = measured_freqs[low_step];
+		int32_t high_freq = measured_freqs[high_step];
+		uint8_t spread = max(measured_quality[low_step] & OM_STEP_SPREAD_MASK, measured_quality[high_step] & OM_STEP_SPREAD_MASK);
+		for(uint16_t i = low_step+1; i < high_step; i++){
+			measured_freqs[i] = low_freq + (int32_t)((int64_t)(high_freq - low_freq)*(i - low_step)/(high_step - low_step));
+			if(is_final){
+				measured_quality[i] = spread;
+			}
+		}
+		low_step = high_step;
+	}
+}
+
+void oMIDItone::plan_fine_steps(void)
+{
+	for(int i=0; i<OM_NUM_RESISTANCE_STEPS/8; i++){
+		fine_steps[i] = 0;
+	}
+	//fill in the gaps so the note boundaries can be found, but leave them marked as unmeasured:
+	interpolate_unmeasured_steps(false);
+
+	//go through the coarse steps three at a time, looking for noise and bends:
+	uint16_t low_step = OM_RESISTANCE_MARGIN;
+	uint16_t middle_step = OM_RESISTANCE_MARGIN;
+	for(uint16_t high_step = OM_RESISTANCE_MARGIN+1; high_step <= calibration_top; high_step++){
+		if(measured_quality[high_step] & OM_STEP_NOT_MEASURED){
+			continue;
+		}
+		//if either end of a gap was noisy or had to be filled in, the line between them can't be trusted:
+		if(!step_is_stable(middle_step) || !step_is_stable(high_step)){
+			mark_fine_steps(middle_step, high_step);
+		}
+		//compare the middle step to the straight line between the ones on either side of it:
+		if(low_step < middle_step){
+			int64_t line = (int64_t)measured_freqs[low_step]*(high_step - middle_step) + (int64_t)measured_freqs[high_step]*(middle_step - low_step);
+			int64_t actual = (int64_t)measured_freqs[middle_step]*(high_step - low_step);
+			int64_t bend = (line > actual) ? line - actual : actual - line;
+			if(bend*100 > actual*OM_CALIBRATION_MAX_BEND){
+				mark_fine_steps(low_step, high_step);
+			}
+		}
+		low_step = middle_step;
+		middle_step = high_step;
+	}
+
+	//and measure the steps on either side of where each note falls, since those are where freq_to_resistance() starts notes:
+	for(int n=0; n<MIDI_NUM_NOTES; n++){
+		om_period_t note_freq = OM_US_TO_PERIOD(A440_MIDI_freqs[n]);
+		if(note_freq > measured_freqs[OM_RESISTANCE_MARGIN] || note_freq <= measured_freqs[calibration_top]){
+			continue;
+		}
+		uint16_t step = first_step_below(note_freq, OM_RESISTANCE_MARGIN, calibration_top);
+		mark_fine_steps(step-1, step);
+	}
+}
+
+void oMIDItone::mark_fine_steps(uint16_t first, uint16_t last)
+{
+	for(uint16_t i=first; i<=last && i<=calibration_top; i++){
+		if(measured_quality[i] & OM_STEP_NOT_MEASURED){
+			fine_steps[i/8] |= (1 << (i%8));
+		}
+	}
+}
+
+uint16_t oMIDItone::next_fine_step(uint16_t resistance)
+{
+	for(uint16_t i=resistance; i<=calibration_top; i++){
+		if(fine_steps[i/8] & (1 << (i%8))){
+			return i;
+		}
+	}
+	return calibration_top+1;
+}
+
+void oMIDItone::request_freq(om_period_t freq)
+{
+	if(control_mode == OM_CONTROL_IN_LOOP){
+		if(freq == OM_NO_FREQ){
+			current_desired_freq = OM_NO_FREQ;
+		} else {
+			set_freq(freq);
+		}
+		return;
+	}
+	//the frequency has to be in the mailbox before the sequence number says there's something new:
+	requested_freq = freq;
+	request_sequence = request_sequence + 1;
+}
+
+om_period_t oMIDItone::latest_desired_freq(void)
+{
+	if(control_mode == OM_CONTROL_IN_TIMER && request_sequence != applied_request_sequence){
+		return requested_freq;
+	}
+	return current_desired_freq;
+}
+
+void oMIDItone::correction_update(void)
+{
+	//continuously measure the current frequency and adjust the resistance as needed.
+	if(pitch_correction_is_enabled){
+		measure_freq();
+	}
+	//and set the resistance to a dithered value based on the adjusted current_resistance.
+	set_dithered_resistance(current_resistance, resistance_fraction);
+}
+
+void oMIDItone::set_freq(om_period_t freq)
 {
 	//set the current_note:
 	current_desired_freq = freq;
-	freq_reading_index = 0;
-	//set the averaging function to the new frequency in anticipation of the change:
-	for(int i=0; i<OM_NUM_FREQ_READINGS; i++){
-		recent_freqs[i] = current_desired_freq;
-	}
-	//set the current_resistance to a value that was previously measured as close to the desired note's frequency.
+	//the old readings were for the old note, so start collecting from scratch:
+	freq_estimator.reset();
+	//start a new span from the last edge, with enough periods in it to fill OM_SPAN_WINDOW at this note:
+	span_start_time = last_rising_edge_time;
+	span_num_periods = 0;
+	span_target_periods = constrain(OM_US_TO_PERIOD(OM_SPAN_WINDOW)/current_desired_freq, OM_MIN_SPAN_PERIODS, OM_MAX_SPAN_PERIODS);
+	//set the current_resistance to a value that was previously measured as close to the desired note's frequency, after allowing for drift.
+	om_period_t table_freq = live_to_table_freq(current_desired_freq);
 	current_resistance = freq_to_resistance(current_desired_freq);
+	resistance_fraction = 0;
+	//if the note falls between this step and the one below it, start the dither at the right fraction of the way between them:
+	if(current_resistance > OM_RESISTANCE_MARGIN && step_is_stable(current_resistance-1)){
+		om_period_t below = measured_freqs[current_resistance-1];
+		om_period_t above = measured_freqs[current_resistance];
+		if(below > table_freq && table_freq > above){
+			current_resistance--;
+			resistance_fraction = ((below - table_freq) << OM_DITHER_FRAC_BITS)/(below - above);
+		}
+	}
+	drift_lock_recorded = false;
+	//and the PI controller works from there:
+	pi_base_resistance = (current_resistance << OM_DITHER_FRAC_BITS) | resistance_fraction;
+	pi_integral = 0;
+	//the first correction for the note can happen as soon as there's a reading:
+	correction_interval = 0;
+	readings_since_correction = 0;
 }
 
 void oMIDItone::measure_freq(void)
 {
 	//this first bit is calculating the average continuously and storing it in current_freq
-	if(is_rising_edge()){
+	//with DMA sampling there can be several rising edges waiting in the buffer, so keep going until they have all been handled.
+	while(is_rising_edge()){
+		//the oscillator is still settling after a resistance change, so this period doesn't say anything about the new resistance yet. Start over from this edge.
+		if(is_settling()){
+			settling_rejected_readings++;
+			span_start_time = last_rising_edge_time;
+			span_num_periods = 0;
+			continue;
+		}
 		//sanity check on the reading - it should never be more than OM_ALLOWABLE_FREQ_READING_VARIANCE percent off of the desired frequency.
-		uint32_t low_bound = current_desired_freq*(100-OM_ALLOWABLE_FREQ_READING_VARIANCE)/100;
-		uint32_t high_bound = current_desired_freq*(100+OM_ALLOWABLE_FREQ_READING_VARIANCE)/100;
-		if((last_rising_edge > low_bound) && (last_rising_edge < high_bound)){
-			//if things are compromised, reset the last_rising_edge and start over:
+		om_period_t low_bound = current_desired_freq*(100-OM_ALLOWABLE_FREQ_READING_VARIANCE)/100;
+		om_period_t high_bound = current_desired_freq*(100+OM_ALLOWABLE_FREQ_READING_VARIANCE)/100;
+		if((rising_edge_period > low_bound) && (rising_edge_period < high_bound)){
+			//if things are compromised, throw out this reading.
+			//The servos flag this every OM_MIN_TIME_BETWEEN_SERVO_MOVEMENTS, which is shorter than a span on low notes, so starting the span over
+			//would mean it never finishes. Instead just this period is left out, by moving the start of the span forward by its length.
 			if(pitch_correction_has_been_compromised){
-				last_rising_edge = 0;
 				//reset the flag so pitch correction can continue until it is interrupted again.
 				pitch_correction_has_been_compromised = false;
+				span_start_time += last_rising_edge_time - previous_rising_edge_time;
 				#ifdef OM_PITCH_DEBUG
 						Serial.println("Pitch Correction Compromised.");
 				#endif
+			} else if(measurement_mode == OM_MEASURE_SPAN){
+				span_num_periods++;
 			} else {
-				recent_freqs[freq_reading_index] = last_rising_edge;
-				last_rising_edge = 0;
+				freq_estimator.add(rising_edge_period);
 				#ifdef OM_PITCH_DEBUG
 					Serial.print("Frequency Successfully measured: ");
-					Serial.println(recent_freqs[freq_reading_index]);
+					Serial.println(OM_PERIOD_TO_US(rising_edge_period));
 				#endif
-				freq_reading_index++;
 			}
 		} else {
-			//take action as if things are compromised and reset the last_rising_edge to start over:
-			last_rising_edge = 0;
+			//take action as if things are compromised and start over from this edge.
 			//reset pitch correction flag so the next reading can be used.
 			pitch_correction_has_been_compromised = false;
+			range_rejected_readings++;
+			span_start_time = last_rising_edge_time;
+			span_num_periods = 0;
 			#ifdef OM_PITCH_DEBUG
 				Serial.println("Last_rising_edge out of valid ranges.");
 			#endif
 		}
-	}
-	if(freq_reading_index >= OM_NUM_FREQ_READINGS){
-		//calculate a new average frequency
-		current_freq = average(recent_freqs, OM_NUM_FREQ_READINGS);
-		//and reset the counter
-		freq_reading_index = 0;
-		//only when you've had a valid reading should the frequency be adjusted
-		if(current_desired_freq != OM_NO_FREQ){
-			adjust_freq();
+		bool reading_is_complete = false;
+		if(measurement_mode == OM_MEASURE_SPAN){
+			if(span_num_periods >= span_target_periods){
+				//the whole span divided by the number of periods in it is the average period:
+				current_freq = ((last_rising_edge_time - span_start_time)/OM_CYCLES_PER_PERIOD_UNIT)/span_num_periods;
+				#ifdef OM_PITCH_DEBUG
+					Serial.print("Frequency Successfully measured over ");
+					Serial.print(span_num_periods);
+					Serial.print(" periods: ");
+					Serial.println(OM_PERIOD_TO_US(current_freq));
+				#endif
+				//and start the next span from this edge
+				span_start_time = last_rising_edge_time;
+				span_num_periods = 0;
+				reading_is_complete = true;
+			}
+		} else if(freq_estimator.is_full()){
+			//once there are enough readings, every new edge gives a new estimate:
+			current_freq = freq_estimator.estimate();
+			reading_is_complete = true;
+		}
+		if(reading_is_complete){
+			readings_since_correction++;
+			//update the measured_freqs array to be correct for the current resistance, before a correction moves it:
+			if(calibration_learning_is_enabled){
+				learn_measured_freq();
+			}
+			//only when you've had a valid reading should the frequency be adjusted
+			if(current_desired_freq != OM_NO_FREQ){
+				uint16_t previous_resistance = current_resistance;
+				adjust_freq();
+				//readings from before a resistance change shouldn't be used to judge the next one:
+				if(current_resistance != previous_resistance){
+					freq_estimator.reset();
+				}
+			}
 		}
-		//also update the measured_freqs array to be correct for the current resistasnce.
-		//Leaving this commented out for now, seems to prevent drifting over time, but requires occasional hard resets
-		//measured_freqs[current_resistance] = current_freq;
 	}
 }
 
 void oMIDItone::adjust_freq(void)
 {
-	//the next bit will adjust the current jittered resistance value up or down depending on how close the current_freq is to the desired frequency of the current_note, and store it in the MIDI_to_resistance array
-	if(last_adjust_time > OM_TIME_BETWEEN_FREQ_CORRECTIONS){
+	//the next bit will adjust the current resistance value up or down depending on how close the current_freq is to the desired frequency of the current_note, and store it in the MIDI_to_resistance array
+	if(readings_since_correction >= OM_MIN_FRESH_READINGS && last_adjust_time > correction_interval){
+		if(correction_mode == OM_CORRECTION_PI){
+			pi_adjust_freq();
+			return;
+		}
+
 		//this determines the allowable range that the frequency can be in to avoid triggering a retune:
 
 		//this is the range of frequencies acceptable for the current pitch-bent note being played.
-		uint32_t max_allowable_freq = current_desired_freq*(100-OM_ALLOWABLE_NOTE_ERROR)/100;
-		uint32_t min_allowable_freq = current_desired_freq*(100+OM_ALLOWABLE_NOTE_ERROR)/100;
+		om_period_t max_allowable_freq = current_desired_freq*(100-OM_ALLOWABLE_NOTE_ERROR)/100;
+		om_period_t min_allowable_freq = current_desired_freq*(100+OM_ALLOWABLE_NOTE_ERROR)/100;
 
 		if(current_freq >= max_allowable_freq && current_freq <= min_allowable_freq){
-			//Don't adjust anything.
+			//Don't adjust anything, but the note has locked, so use it to keep track of drift.
+			if(!drift_lock_recorded){
+				update_drift_estimate();
+			}
 		} else if(current_freq < max_allowable_freq){
-			current_resistance--;
+			uint16_t steps = correction_step_size();
 			//Only correct if the resistance is too low
-			if(current_resistance < OM_JITTER){
+			if(current_resistance <= OM_RESISTANCE_MARGIN){
 				//prevent the value from overflowing:
-				current_resistance = OM_JITTER;
+				current_resistance = OM_RESISTANCE_MARGIN;
 				//if it's bottoming out, increase the largest freq.
-				largest_freq = current_freq;
-				#ifdef OM_DEBUG
-					Serial.print("Inverted frequency ");
-					Serial.print(current_freq);
-					Serial.print(" bottomed out on oMIDItone on relay pin");
-					Serial.println(signal_enable_optoisolator_pin);
-				#endif
+				largest_freq = live_to_table_freq(current_freq);
+				//save the details for print_dropped_note():
+				dropped_note_freq = current_freq;
+				dropped_note_reason = OM_DROP_BOTTOMED_OUT;
 				//stop playing the note if it bottoms out
 				current_desired_freq = OM_NO_FREQ;
-				//set the new_note_dropped flag:
-				new_note_dropped = true;
+				//count the dropped note:
+				notes_dropped++;
+			} else {
+				//move as far as the slope says is needed, without going past the bottom:
+				if(steps > current_resistance - OM_RESISTANCE_MARGIN){
+					steps = current_resistance - OM_RESISTANCE_MARGIN;
+				}
+				//don't stop on a step that was unstable during the startup test if there's a better one nearby:
+				current_resistance = skip_unstable_steps(current_resistance - steps, -1);
 			}
-			last_adjust_time = 0;
+			schedule_next_correction();
 			#ifdef OM_PITCH_DEBUG_VERBOSE
 				Serial.print("Inverted frequency ");
-				Serial.print(current_freq);
+				Serial.print(OM_PERIOD_TO_US(current_freq));
 				Serial.print(" resistance adjusted to ");
 				Serial.println(current_resistance);
 			#endif
 		} else if(current_freq > min_allowable_freq){
-			current_resistance++;
+			uint16_t steps = correction_step_size();
 			//Only correct if the resistance is too high
-			if(current_resistance > (OM_NUM_RESISTANCE_STEPS-OM_JITTER)){
+			if(current_resistance >= (OM_NUM_RESISTANCE_STEPS-OM_RESISTANCE_MARGIN)){
 				//prevent the value from overflowing:
-				current_resistance = OM_NUM_RESISTANCE_STEPS-OM_JITTER;
+				current_resistance = OM_NUM_RESISTANCE_STEPS-OM_RESISTANCE_MARGIN;
 				//if it's topping out, decrease the largest freq.
-				smallest_freq = current_freq;
-				#ifdef OM_DEBUG
-					Serial.print("Inverted frequency ");
-					Serial.print(current_freq);
-					Serial.print(" topped out on oMIDItone on relay pin ");
-					Serial.println(signal_enable_optoisolator_pin);
-				#endif
+				smallest_freq = live_to_table_freq(current_freq);
+				//save the details for print_dropped_note():
+				dropped_note_freq = current_freq;
+				dropped_note_reason = OM_DROP_TOPPED_OUT;
 				//stop playing the note if it topped out
 				current_desired_freq = OM_NO_FREQ;
-				//set the new_note_dropped flag:
-				new_note_dropped = true;
+				//count the dropped note:
+				notes_dropped++;
+			} else {
+				//move as far as the slope says is needed, without going past the top:
+				if(steps > (OM_NUM_RESISTANCE_STEPS-OM_RESISTANCE_MARGIN) - current_resistance){
+					steps = (OM_NUM_RESISTANCE_STEPS-OM_RESISTANCE_MARGIN) - current_resistance;
+				}
+				//don't stop on a step that was unstable during the startup test if there's a better one nearby:
+				current_resistance = skip_unstable_steps(current_resistance + steps, 1);
 			}
-			last_adjust_time = 0;
+			schedule_next_correction();
 			#ifdef OM_PITCH_DEBUG_VERBOSE
 				Serial.print("Inverted frequency ");
-				Serial.print(current_freq);
+				Serial.print(OM_PERIOD_TO_US(current_freq));
 				Serial.print(" resistance adjusted to ");
 				Serial.println(current_resistance);
 			#endif
 		}
-	}//if(last_adjustment_time > MIN_TIME_BETWEEN_FREQUENCY_CORRECTIONS)
+	}//if(last_adjust_time > correction_interval)
+}
+
+void oMIDItone::pi_adjust_freq(void)
+{
+	//the error is positive when the inverted frequency is too long, which needs more resistance to fix:
+	int32_t error = ((int32_t)current_freq - (int32_t)current_desired_freq)*1000/(int32_t)current_desired_freq;
+
+	//the first time the note is close enough, use it to keep track of drift:
+	if(!drift_lock_recorded && abs(error) <= OM_ALLOWABLE_NOTE_ERROR*10){
+		update_drift_estimate();
+	}
+
+	int32_t integral = pi_integral + (int32_t)pi_ki*error;
+	const int32_t max_integral = (int32_t)OM_PI_MAX_INTEGRAL_STEPS << 8;
+	integral = constrain(integral, -max_integral, max_integral);
+
+	//the output is in 1/256ths of a step, so it can be rounded to the nearest one at the end:
+	int32_t output = ((int32_t)pi_base_resistance << (8-OM_DITHER_FRAC_BITS)) + (int32_t)pi_kp*error + integral;
+	const int32_t lowest_output = (int32_t)OM_RESISTANCE_MARGIN << 8;
+	const int32_t highest_output = (int32_t)(OM_NUM_RESISTANCE_STEPS-OM_RESISTANCE_MARGIN) << 8;
+	bool saturated = false;
+	if(output < lowest_output){
+		output = lowest_output;
+		saturated = true;
+		//anti-windup: only let the integral keep growing if it's pulling back away from the limit:
+		if(error > 0){
+			pi_integral = integral;
+		}
+	} else if(output > highest_output){
+		output = highest_output;
+		saturated = true;
+		if(error < 0){
+			pi_integral = integral;
+		}
+	} else {
+		pi_integral = integral;
+	}
+
+	//round the output to the nearest fraction of a step that the dither can play:
+	uint16_t previous_resistance = current_resistance;
+	output = (output + (1 << (7-OM_DITHER_FRAC_BITS))) >> (8-OM_DITHER_FRAC_BITS);
+	current_resistance = output >> OM_DITHER_FRAC_BITS;
+	resistance_fraction = output & ((1 << OM_DITHER_FRAC_BITS) - 1);
+	schedule_next_correction();
+
+	//if the controller was already stuck at a limit and the note still isn't close enough, the head can't play it:
+	if(saturated && current_resistance == previous_resistance && abs(error) > OM_ALLOWABLE_NOTE_ERROR*10){
+		if(current_resistance == OM_RESISTANCE_MARGIN){
+			largest_freq = live_to_table_freq(current_freq);
+		} else {
+			smallest_freq = live_to_table_freq(current_freq);
+		}
+		//save the details for print_dropped_note():
+		dropped_note_freq = current_freq;
+		dropped_note_reason = OM_DROP_PI_SATURATED;
+		//stop playing the note and count it as dropped:
+		current_desired_freq = OM_NO_FREQ;
+		notes_dropped++;
+	}
+
+	#ifdef OM_PITCH_DEBUG_VERBOSE
+		Serial.print("Inverted frequency ");
+		Serial.print(OM_PERIOD_TO_US(current_freq));
+		Serial.print(" error ");
+		Serial.print(error);
+		Serial.print(" resistance adjusted to ");
+		Serial.println(current_resistance);
+	#endif
+}
+
+void oMIDItone::schedule_next_correction(void)
+{
+	last_adjust_time = 0;
+	readings_since_correction = 0;
+	//if the note was just dropped there's nothing to schedule:
+	if(current_desired_freq == OM_NO_FREQ){
+		correction_interval = OM_MIN_CORRECTION_INTERVAL;
+		return;
+	}
+	//wait long enough for the next reading to be all new periods of the note:
+	uint32_t interval = OM_PERIOD_TO_US(current_desired_freq)*OM_CORRECTION_INTERVAL_PERIODS;
+	//and wait longer when it's already close, since the rest of the error is mostly noise:
+	om_period_t error = (current_freq > current_desired_freq) ? current_freq - current_desired_freq : current_desired_freq - current_freq;
+	if(error*100 < current_desired_freq*OM_ALLOWABLE_NOTE_ERROR*OM_NEAR_LOCK_ERROR_MULTIPLIER){
+		interval *= OM_NEAR_LOCK_INTERVAL_MULTIPLIER;
+	}
+	correction_interval = constrain(interval, (uint32_t)OM_MIN_CORRECTION_INTERVAL, (uint32_t)OM_MAX_CORRECTION_INTERVAL);
+}
+
+uint16_t oMIDItone::correction_step_size(void)
+{
+	//find the average change in inverted frequency per step around the current resistance. measured_freqs gets smaller as the resistance goes up.
+	int32_t low_step = current_resistance - OM_CORRECTION_SLOPE_SPAN;
+	int32_t high_step = current_resistance + OM_CORRECTION_SLOPE_SPAN;
+	if(low_step < OM_RESISTANCE_MARGIN){
+		low_step = OM_RESISTANCE_MARGIN;
+	}
+	if(high_step > OM_NUM_RESISTANCE_STEPS-OM_RESISTANCE_MARGIN){
+		high_step = OM_NUM_RESISTANCE_STEPS-OM_RESISTANCE_MARGIN;
+	}
+	if(high_step <= low_step){
+		return 1;
+	}
+	int32_t slope = ((int32_t)table_to_live_freq(measured_freqs[low_step]) - (int32_t)table_to_live_freq(measured_freqs[high_step]))/(high_step - low_step);
+	//if the table is flat or backwards here, it can't be trusted to say how far to go, so just take one step:
+	if(slope <= 0){
+		return 1;
+	}
+
+	//this rounds down, so it will come up a little short rather than overshoot:
+	uint32_t error = (current_freq > current_desired_freq) ? current_freq - current_desired_freq : current_desired_freq - current_freq;
+	uint32_t steps = error/slope;
+	if(steps < 1){
+		steps = 1;
+	}
+	if(steps > OM_MAX_CORRECTION_STEPS){
+		steps = OM_MAX_CORRECTION_STEPS;
+	}
+	return steps;
 }
 
 bool oMIDItone::can_play_freq(uint32_t freq)
+{
+	//the control interrupt can change the range or the drift estimate part way through the check:
+	noInterrupts();
+	bool is_playable = can_play_period(OM_US_TO_PERIOD(freq));
+	interrupts();
+	return is_playable;
+}
+
+void oMIDItone::print_dropped_note(void)
+{
+	uint32_t dropped = notes_dropped;
+	if(dropped == notes_dropped_printed){
+		return;
+	}
+	notes_dropped_printed = dropped;
+	noInterrupts();
+	om_period_t freq = dropped_note_freq;
+	uint8_t reason = dropped_note_reason;
+	interrupts();
+	Serial.print("Inverted frequency ");
+	Serial.print(OM_PERIOD_TO_US(freq));
+	if(reason == OM_DROP_BOTTOMED_OUT){
+		Serial.print(" bottomed out on oMIDItone on relay pin ");
+	} else if(reason == OM_DROP_TOPPED_OUT){
+		Serial.print(" topped out on oMIDItone on relay pin ");
+	} else {
+		Serial.print(" saturated the PI controller on oMIDItone on relay pin ");
+	}
+	Serial.println(signal_enable_optoisolator_pin);
+}
+
+bool oMIDItone::can_play_period(om_period_t freq)
 {
 	//some initial conditions to return false immediately before doing the pitch adjusted frequency calculation to save time
 	if(!had_successful_init){
@@ -554,12 +1452,166 @@ bool oMIDItone::can_play_freq(uint32_t freq)
 	if(freq == OM_NO_FREQ){
 		return false;
 	}
-	if(freq < largest_freq && freq > smallest_freq){
+	//the range was measured in table terms, so compare it to where the note would be in the table after drift:
+	om_period_t table_freq = live_to_table_freq(freq);
+	if(table_freq < largest_freq && table_freq > smallest_freq){
 		return true;
 	}
 	return false;
 }
 
+void oMIDItone::learn_measured_freq(void)
+{
+	//a reading is only trusted if the one before it was taken at the same resistance and agrees with it:
+	uint16_t fractional_resistance = (current_resistance << OM_DITHER_FRAC_BITS) | resistance_fraction;
+	om_period_t previous_freq = learning_candidate_freq;
+	bool same_resistance = (fractional_resistance == learning_candidate_resistance);
+	learning_candidate_freq = current_freq;
+	learning_candidate_resistance = fractional_resistance;
+	if(!same_resistance || previous_freq == OM_NO_FREQ){
+		return;
+	}
+	om_period_t difference = (current_freq > previous_freq) ? current_freq - previous_freq : previous_freq - current_freq;
+	if(difference*100 > current_freq*OM_LEARNING_CONFIRM_SPREAD){
+		return;
+	}
+	if(last_learning_time < OM_LEARNING_INTERVAL){
+		return;
+	}
+	//leave steps that were bad at startup alone, and stay clear of the ends of the table:
+	if(current_resistance < OM_RESISTANCE_MARGIN || current_resistance+1 >= OM_NUM_RESISTANCE_STEPS-OM_RESISTANCE_MARGIN){
+		return;
+	}
+	if(!step_is_stable(current_resistance) || (resistance_fraction > 0 && !step_is_stable(current_resistance+1))){
+		return;
+	}
+
+	//while dithering, the reading is for a point between two steps, so compare it to the table interpolated to that point.
+	//The drift estimate already covers the whole table moving, so only what it doesn't explain is learned:
+	om_period_t predicted_freq = table_freq_at(current_resistance, resistance_fraction);
+	om_period_t reading_freq = live_to_table_freq(current_freq);
+
+	//and move both steps by the same amount to take the table part of the way to the reading:
+	int32_t change = ((int32_t)reading_freq - (int32_t)predicted_freq)/(1 << OM_LEARNING_SHIFT);
+	if(change == 0){
+		return;
+	}
+	nudge_measured_freq(current_resistance, change);
+	if(resistance_fraction > 0){
+		nudge_measured_freq(current_resistance+1, change);
+	}
+	last_learning_time = 0;
+	calibration_updates++;
+	update_note_cache(current_resistance, (resistance_fraction > 0) ? current_resistance+1 : current_resistance);
+	#ifdef OM_PITCH_DEBUG_VERBOSE
+		Serial.print("Resistance ");
+		Serial.print(current_resistance);
+		Serial.print(" learned inverted frequency ");
+		Serial.println(OM_PERIOD_TO_US(measured_freqs[current_resistance]));
+	#endif
+}
+
+void oMIDItone::nudge_measured_freq(uint16_t resistance, int32_t change)
+{
+	int32_t freq = measured_freqs[resistance];
+	int32_t max_change = freq*OM_LEARNING_MAX_CHANGE/100;
+	if(max_change < 1){
+		max_change = 1;
+	}
+	freq += constrain(change, -max_change, max_change);
+	//measured_freqs gets smaller as the resistance goes up, so keep this entry between its neighbours:
+	if(resistance > 0 && freq > (int32_t)measured_freqs[resistance-1]){
+		freq = measured_freqs[resistance-1];
+	}
+	if(resistance+1 < OM_NUM_RESISTANCE_STEPS && freq < (int32_t)measured_freqs[resistance+1]){
+		freq = measured_freqs[resistance+1];
+	}
+	measured_freqs[resistance] = freq;
+}
+
+om_period_t oMIDItone::table_freq_at(uint16_t resistance, uint8_t fraction)
+{
+	om_period_t step_freq = measured_freqs[resistance];
+	if(fraction == 0 || resistance+1 >= OM_NUM_RESISTANCE_STEPS){
+		return step_freq;
+	}
+	om_period_t next_step_freq = measured_freqs[resistance+1];
+	if(step_freq <= next_step_freq){
+		return step_freq;
+	}
+	return step_freq - (((step_freq - next_step_freq)*fraction) >> OM_DITHER_FRAC_BITS);
+}
+
+om_period_t oMIDItone::table_to_live_freq(om_period_t freq)
+{
+	int64_t live = (((int64_t)freq*drift_scale) >> OM_DRIFT_SCALE_FRAC_BITS) + drift_offset;
+	if(live < 1){
+		return 1;
+	}
+	return live;
+}
+
+om_period_t oMIDItone::live_to_table_freq(om_period_t freq)
+{
+	if(freq == OM_NO_FREQ){
+		return OM_NO_FREQ;
+	}
+	int64_t table = (((int64_t)freq - drift_offset) << OM_DRIFT_SCALE_FRAC_BITS)/drift_scale;
+	if(table < 1){
+		return 1;
+	}
+	return table;
+}
+
+void oMIDItone::update_drift_estimate(void)
+{
+	drift_lock_recorded = true;
+	int32_t table = table_freq_at(current_resistance, resistance_fraction);
+	int32_t live = current_freq;
+	if(table <= 0 || live <= 0){
+		return;
+	}
+
+	//keep exponential moving averages of the points and how they vary, starting from the first lock:
+	if(drift_num_locks == 0){
+		drift_mean_table = table;
+		drift_mean_live = live;
+		drift_variance = 0;
+		drift_covariance = 0;
+	} else {
+		drift_mean_table += (table - drift_mean_table)/(1 << OM_DRIFT_SHIFT);
+		drift_mean_live += (live - drift_mean_live)/(1 << OM_DRIFT_SHIFT);
+		int64_t table_difference = table - drift_mean_table;
+		int64_t live_difference = live - drift_mean_live;
+		drift_variance += (table_difference*table_difference - drift_variance)/(1 << OM_DRIFT_SHIFT);
+		drift_covariance += (table_difference*live_difference - drift_covariance)/(1 << OM_DRIFT_SHIFT);
+	}
+	drift_num_locks++;
+
+	//with the locks spread out enough, fit the scale and offset with least squares. Otherwise the oscillator drifting in proportion is the best guess:
+	int64_t min_spread = (int64_t)drift_mean_table*OM_DRIFT_MIN_SPREAD/100;
+	int64_t scale;
+	if(drift_variance > min_spread*min_spread){
+		scale = (drift_covariance << OM_DRIFT_SCALE_FRAC_BITS)/drift_variance;
+	} else {
+		scale = ((int64_t)drift_mean_live << OM_DRIFT_SCALE_FRAC_BITS)/drift_mean_table;
+	}
+	const int64_t one = 1LL << OM_DRIFT_SCALE_FRAC_BITS;
+	scale = constrain(scale, one*(100-OM_DRIFT_MAX_CHANGE)/100, one*(100+OM_DRIFT_MAX_CHANGE)/100);
+	int64_t offset = drift_mean_live - ((drift_mean_table*scale) >> OM_DRIFT_SCALE_FRAC_BITS);
+	int64_t max_offset = (int64_t)drift_mean_table*OM_DRIFT_MAX_CHANGE/100;
+	offset = constrain(offset, -max_offset, max_offset);
+	drift_scale = scale;
+	drift_offset = offset;
+
+	#ifdef OM_PITCH_DEBUG_VERBOSE
+		Serial.print("Drift estimate scale ");
+		Serial.print(drift_scale);
+		Serial.print(" offset ");
+		Serial.println(drift_offset);
+	#endif
+}
+
 void oMIDItone::servo_update(void)
 {
 	//If the current_desired_freq is not OM_NO_FREQ, open the mouth to the max position:
@@ -575,88 +1627,254 @@ void oMIDItone::servo_update(void)
 	}
 }
 
+bool oMIDItone::is_settling(void)
+{
+	if(!resistance_is_settling){
+		return false;
+	}
+	//edges from before the change can still be waiting in the backend when it happens, and the period that spans the change is no good either:
+	int32_t time_since_change = (int32_t)(last_rising_edge_time - resistance_change_time);
+	if(time_since_change <= 0){
+		return true;
+	}
+	if(settling_periods_left > 0){
+		settling_periods_left--;
+		return true;
+	}
+	if(time_since_change < (int32_t)settling_cycles){
+		return true;
+	}
+	resistance_is_settling = false;
+	return false;
+}
+
 bool oMIDItone::is_rising_edge(void)
 {
-	if(last_rising_edge > OM_MIN_TIME_BETWEEN_RISING_EDGE_MEASUREMENTS){
-	uint16_t current_analog_read = adc->analogRead(analog_feedback_pin);
-		if( current_analog_read > OM_RISING_EDGE_THRESHOLD && last_analog_read < OM_RISING_EDGE_THRESHOLD){
-			last_analog_read = current_analog_read;
-			return true;
+	uint32_t edge_time;
+	if(!backend->read_edge(&edge_time)){
+		return false;
+	}
+	//the timestamps are in CPU cycles, which divide evenly into om_period_t units:
+	rising_edge_period = (edge_time - last_rising_edge_time)/OM_CYCLES_PER_PERIOD_UNIT;
+	previous_rising_edge_time = last_rising_edge_time;
+	last_rising_edge_time = edge_time;
+	return true;
+}
+
+uint32_t oMIDItone::time_since_rising_edge(void)
+{
+	return backend->current_time() - last_rising_edge_time;
+}
+
+uint16_t oMIDItone::freq_to_resistance(om_period_t freq)
+{
+	//the table is in the terms it was measured in, so look for where the note is after drift:
+	freq = live_to_table_freq(freq);
+
+	//find the A440 notes on either side of the frequency. A440_MIDI_freqs gets smaller as the note goes up:
+	uint16_t low = OM_RESISTANCE_MARGIN+2;
+	uint16_t high = OM_NUM_RESISTANCE_STEPS-OM_RESISTANCE_MARGIN-2;
+	int note_low = 0;
+	int note_high = MIDI_NUM_NOTES;
+	while(note_low < note_high){
+		int note = (note_low + note_high)/2;
+		if(OM_US_TO_PERIOD(A440_MIDI_freqs[note]) >= freq){
+			note_low = note + 1;
 		} else {
-			last_analog_read = current_analog_read;
-			return false;
+			note_high = note;
 		}
-	} else {
-		return false;
 	}
+	//the step for the frequency is somewhere between the cached steps for those two notes:
+	if(note_low > 0){
+		low = note_resistance_cache[note_low-1];
+	}
+	if(note_low < MIDI_NUM_NOTES){
+		high = note_resistance_cache[note_low];
+	}
+	uint16_t i = first_step_below(freq, low, high);
+
+	//If none of the steps were below the frequency, return the max value.
+	if(i >= OM_NUM_RESISTANCE_STEPS-OM_RESISTANCE_MARGIN-2){
+		return OM_NUM_RESISTANCE_STEPS-OM_RESISTANCE_MARGIN;
+	}
+	if(step_is_stable(i)){
+		return i;
+	}
+	//look for the closest stable step on either side:
+	for(int distance=1; distance<=OM_STABLE_STEP_SEARCH_DISTANCE; distance++){
+		if(i-distance >= OM_RESISTANCE_MARGIN && step_is_stable(i-distance)){
+			return i-distance;
+		}
+		if(i+distance <= OM_NUM_RESISTANCE_STEPS-OM_RESISTANCE_MARGIN && step_is_stable(i+distance)){
+			return i+distance;
+		}
+	}
+	return i;
 }
 
-uint32_t oMIDItone::average(uint32_t * array, uint16_t num_elements)
+uint16_t oMIDItone::first_step_below(om_period_t freq, uint16_t low, uint16_t high)
 {
-	uint32_t total = 0;
-	for(uint16_t i=0; i<num_elements; i++){
-		total = total + array[i];
+	while(low < high){
+		uint16_t middle = (low + high)/2;
+		if(measured_freqs[middle] < freq){
+			high = middle;
+		} else {
+			low = middle + 1;
+		}
 	}
-	return total/num_elements;
+	return low;
 }
 
-uint16_t oMIDItone::freq_to_resistance(uint16_t freq)
+void oMIDItone::make_measured_freqs_monotonic(void)
 {
-	//iterate through the measured_freqs array and check for when the frequency has gone over the desired frequency by one step.
-	for(int i=OM_JITTER+2; i<OM_NUM_RESISTANCE_STEPS-OM_JITTER-2; i++){
-		//If the frequency if higher than the current note (less us) then set the MIDI_to_resistance value and increment the note:
-		if(measured_freqs[i] < freq){
-			return i;
+	//the steps below the margin are never played, but fill them in so the whole table is in order:
+	for(int i=0; i<OM_RESISTANCE_MARGIN; i++){
+		measured_freqs[i] = measured_freqs[OM_RESISTANCE_MARGIN];
+	}
+	//a step that measured longer than the one before it can't be right, so use the one before it instead:
+	for(int i=OM_RESISTANCE_MARGIN+1; i<OM_NUM_RESISTANCE_STEPS; i++){
+		if(measured_freqs[i] > measured_freqs[i-1]){
+			measured_freqs[i] = measured_freqs[i-1];
+			measured_quality[i] |= OM_STEP_SUBSTITUTED;
 		}
 	}
-	//if none of the above matched, return the max value.
-	return OM_NUM_RESISTANCE_STEPS-OM_JITTER;
 }
 
-void oMIDItone::set_jitter_resistance(uint16_t resistance, uint16_t jitter)
+void oMIDItone::rebuild_note_cache(void)
 {
-	uint16_t current_jitter = random(jitter);
-	uint16_t positive = random(1);
-	if(positive){
-		set_resistance(resistance + current_jitter);
-	} else {
-		set_resistance(resistance - current_jitter);
+	uint16_t low = OM_RESISTANCE_MARGIN+2;
+	const uint16_t high = OM_NUM_RESISTANCE_STEPS-OM_RESISTANCE_MARGIN-2;
+	//each note is higher than the one before it, so its step can't be lower:
+	for(int n=0; n<MIDI_NUM_NOTES; n++){
+		low = first_step_below(OM_US_TO_PERIOD(A440_MIDI_freqs[n]), low, high);
+		note_resistance_cache[n] = low;
+	}
+}
+
+void oMIDItone::update_note_cache(uint16_t first, uint16_t last)
+{
+	//a note's cached step can only move if the note is between the unchanged steps on either side of the ones that changed,
+	//and then it has to land on one of the changed steps or the step just after them:
+	om_period_t top = measured_freqs[first-1];
+	om_period_t bottom = measured_freqs[last+1];
+	uint16_t low = first;
+	if(low < OM_RESISTANCE_MARGIN+2){
+		low = OM_RESISTANCE_MARGIN+2;
+	}
+	uint16_t high = last+1;
+	if(high > OM_NUM_RESISTANCE_STEPS-OM_RESISTANCE_MARGIN-2){
+		high = OM_NUM_RESISTANCE_STEPS-OM_RESISTANCE_MARGIN-2;
+	}
+	if(low > high){
+		return;
+	}
+	//the notes go from the longest inverted frequency to the shortest:
+	for(int n=0; n<MIDI_NUM_NOTES; n++){
+		om_period_t note_freq = OM_US_TO_PERIOD(A440_MIDI_freqs[n]);
+		if(note_freq > top){
+			continue;
+		}
+		if(note_freq <= bottom){
+			break;
+		}
+		note_resistance_cache[n] = first_step_below(note_freq, low, high);
+	}
+}
+
+bool oMIDItone::step_is_stable(uint16_t resistance)
+{
+	if(resistance >= OM_NUM_RESISTANCE_STEPS){
+		return false;
+	}
+	uint8_t quality = measured_quality[resistance];
+	if(quality & (OM_STEP_NOT_MEASURED | OM_STEP_SUBSTITUTED | OM_STEP_TIMED_OUT)){
+		return false;
+	}
+	return (quality & OM_STEP_SPREAD_MASK) <= OM_MAX_STABLE_STEP_SPREAD;
+}
+
+uint16_t oMIDItone::skip_unstable_steps(uint16_t resistance, int8_t direction)
+{
+	int32_t step = resistance;
+	for(int distance=0; distance<=OM_STABLE_STEP_SEARCH_DISTANCE; distance++){
+		if(step < OM_RESISTANCE_MARGIN || step > OM_NUM_RESISTANCE_STEPS-OM_RESISTANCE_MARGIN){
+			break;
+		}
+		if(step_is_stable(step)){
+			return step;
+		}
+		step += direction;
+	}
+	return resistance;
+}
+
+void oMIDItone::set_dithered_resistance(uint16_t resistance, uint8_t fraction)
+{
+	//only a change in the resistance being dithered around starts the settling window over, not the dither itself:
+	uint16_t fractional_resistance = (resistance << OM_DITHER_FRAC_BITS) | fraction;
+	if(fractional_resistance != last_set_resistance){
+		last_set_resistance = fractional_resistance;
+		resistance_is_settling = true;
+		resistance_change_time = backend->current_time();
+		settling_periods_left = settling_periods;
+	}
+
+	//first order sigma-delta: add the fraction every OM_DITHER_PERIOD, and play the step above whenever it adds up to a whole step.
+	//Between dither updates the same step is kept, so how often this is called doesn't change how often the pots are written.
+	if(last_dither_time >= OM_DITHER_PERIOD){
+		last_dither_time = 0;
+		dither_accumulator += fraction;
+		dither_is_high = dither_accumulator >= (1 << OM_DITHER_FRAC_BITS);
+		if(dither_is_high){
+			dither_accumulator -= (1 << OM_DITHER_FRAC_BITS);
+		}
+	}
+	uint16_t output = resistance;
+	if(dither_is_high && fraction != 0){
+		output++;
+	}
+
+	//the output only changes when the resistance changes or the dither crosses over, so skip the SPI writes the rest of the time:
+	if(output != last_written_resistance){
+		last_written_resistance = output;
+		set_resistance(output);
 	}
 }
 
 void oMIDItone::set_resistance(uint16_t resistance)
 {
+	backend->resistance_changed(resistance);
 	//The case where we need to oscillate the 50k pot to increase resolution:
 	if(resistance >= 0 && resistance <= 512){
 		//this is divided by 2, so it returns a number between 0 and 256.
-		set_pot(cs1_pin, resistance/2);
-		//this sets to either 0 or 1 depending on the modulus with 2.
+		//the 50k pot is set to either 0 or 1 depending on the modulus with 2.
 		if(resistance % 2){
-			set_pot(cs2_pin, 0);
+			set_pots(resistance/2, 0);
 		} else {
-			set_pot(cs2_pin, 1);
+			set_pots(resistance/2, 1);
 		}
 	} else if(resistance > 512 && resistance <= OM_NUM_RESISTANCE_STEPS) {
 		//The case where the steps are above 512 means to set the 100k pot to 256 and the other to the current resistance value - 512.
-		set_pot(cs1_pin, 256);
-		set_pot(cs2_pin, resistance-512);
+		set_pots(256, resistance-512);
 	} else if(resistance < 0){
-		set_pot(cs1_pin, 0);
-		set_pot(cs2_pin, 0);
+		set_pots(0, 0);
 	} else {
-		set_pot(cs1_pin, 256);
-		set_pot(cs2_pin, 256);
+		set_pots(256, 256);
 	}
 }
 
-void oMIDItone::set_pot(uint16_t CS_pin, uint16_t command_byte)
+void oMIDItone::set_pots(uint16_t pot1_value, uint16_t pot2_value)
 {
-	digitalWrite(CS_pin, LOW); //select chip
-	uint16_t byte_high = command_byte >> 8;
-	uint16_t byte_low = command_byte & 0xff;
-	SPI.transfer(byte_high); //send command first
-	SPI.transfer(byte_low); //send value second
-	digitalWrite(CS_pin, HIGH); //de-select chip when done
+	//most of the time the dither only moves the 50k pot, so only write the pots that actually changed.
+	//The queue sends them in the background, so this doesn't wait for the SPI.
+	if(pot1_value != last_pot1_value){
+		pots->write(pot1_chip, pot1_value);
+		last_pot1_value = pot1_value;
+	}
+	if(pot2_value != last_pot2_value){
+		pots->write(pot2_chip, pot2_value);
+		last_pot2_value = pot2_value;
+	}
 }
 
 /* ----- END PRIVATE FUNCTIONS ----- */
\ No newline at end of file
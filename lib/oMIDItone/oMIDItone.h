@@ -78,25 +78,36 @@ Copyright 2019 - kiyoshigawa - tim@twa.ninja
 
 #include <Arduino.h>
 
-//We will need the SPI library to communicate with the MCP4151 chips.
-#include <SPI.h>
+//This sends the wiper commands to the MCP4151 chips over SPI in the background. It is shared by all the heads.
+#include <PotQueue.h>
 
-//We will also use the fancy faster ADC library from pedvide for Teensy:
-#include <ADC.h>
+//This is the interface to whatever is finding the rising edges of the head's waveform. See PeriodBackend.h for the options.
+#include <PeriodBackend.h>
 
 //This is for the PCA9685 Servo controller.
 #include <i2c_t3.h>
 #include <Adafruit_PWMServoDriver.h>
 
+//This keeps a running median or trimmed mean of the recent frequency readings.
+#include <PeriodEstimator.h>
+
+//This saves the startup test results in the EEPROM, so they can be loaded instead of measured on the next power up.
+#include <CalibrationStore.h>
+
+//This is for the A440_MIDI_freqs note table, which the starting resistance of each note is cached for.
+#include <MIDIController.h>
+
 //this is for the LED lighting so the animation for the head can be stored on the head.
 #include <lighting_control.h>
 
 //This prints out general debug messages for the head.
 //this includes startup test messages and messages that let you know when notes are measured out of range
+//the out of range messages are saved by the pitch correction and printed by update(), so they are safe to use with OM_CONTROL_IN_TIMER
 #define OM_DEBUG
 
 //comment this out to disable pitch debug messages
 //this will turn on or off output messages about the frequency measurements in the measure_freq() function:
+//these and OM_PITCH_DEBUG_VERBOSE print from the pitch correction itself, so they should only be used with OM_CONTROL_IN_LOOP
 //#define OM_PITCH_DEBUG
 
 //comment this out to disable verbose frequency adjustment messages for every change in frequency
@@ -108,6 +119,9 @@ Copyright 2019 - kiyoshigawa - tim@twa.ninja
 //this controls default state of frequency correction
 #define OM_FREQ_CORRECTION_DEFAULT_ENABLE_STATE true
 
+//this controls default state of calibration learning, where measured_freqs is kept up to date from readings taken while notes are playing
+#define OM_CALIBRATION_LEARNING_DEFAULT_ENABLE_STATE true
+
 //this controls default state of servos
 #define OM_SERVO_DEFAULT_ENABLE_STATE true
 
@@ -117,12 +131,32 @@ Copyright 2019 - kiyoshigawa - tim@twa.ninja
 //this is a non-valid frequency value to denote that no sound should be output.
 #define OM_NO_FREQ 0
 
+//Internally, inverted frequencies are kept as fixed point numbers of us with this many fractional bits. See om_period_t below.
+//Rising edges are timestamped with the CPU cycle counter, and 5 bits keeps that down to 3 cycles of resolution at 96MHz.
+//With 5 bits, the longest inverted frequency that can be stored is over two minutes, so there is no risk of overflowing.
+#define OM_PERIOD_FRAC_BITS 5
+
+//This is how many CPU cycles make up the smallest fraction of a us in an om_period_t.
+#define OM_CYCLES_PER_PERIOD_UNIT (F_CPU/(1000000UL << OM_PERIOD_FRAC_BITS))
+#if (F_CPU % (1000000UL << OM_PERIOD_FRAC_BITS)) != 0
+	#error "F_CPU needs to be a multiple of 2^OM_PERIOD_FRAC_BITS MHz for the cycle counter to convert to om_period_t exactly."
+#endif
+
+//these convert between a whole number of us and an om_period_t.
+#define OM_US_TO_PERIOD(us) ((om_period_t)(us) << OM_PERIOD_FRAC_BITS)
+#define OM_PERIOD_TO_US(period) ((uint32_t)((period) >> OM_PERIOD_FRAC_BITS))
+
+//This is a wiper value that can never be written, used to force the next write to a pot to go through.
+#define OM_POT_UNKNOWN 0xFFFF
+
 //this is how many resistance steps can be used with the digital pots. The current hardware has 2 digital pots with 256 steps each,
 //but the 50k pot is alternating every step of the 100k pot, so it adds up to 256+512 = 768 total steps.
 #define OM_NUM_RESISTANCE_STEPS 768
 
-//This is the analog read threshold for a rising edge to count the frequency.
-#define OM_RISING_EDGE_THRESHOLD 50
+//the whole measured_freqs table needs to fit in one head's slot of the EEPROM:
+#if CS_ENCODED_SIZE(OM_NUM_RESISTANCE_STEPS) > CS_SLOT_SIZE
+	#error "measured_freqs is too big to fit in a CalibrationStore slot."
+#endif
 
 //this is the % difference that a note can be off to trigger correction, as a number from 0-100
 #define OM_ALLOWABLE_NOTE_ERROR 1
@@ -133,29 +167,203 @@ Copyright 2019 - kiyoshigawa - tim@twa.ninja
 //this is a multiplier number to check for unreasonably large frequency measurements during the initial startup test.
 #define OM_UNREASONABLY_LARGE_MULTIPLIER 2
 
-//this is to make sure that the rising edge isn't measured too often (in us):
-#define OM_MIN_TIME_BETWEEN_RISING_EDGE_MEASUREMENTS 1
+//During the startup test, the quality of every resistance step is saved along with its frequency, as one byte per step.
+//The low bits are the spread from the lowest to the highest reading at that step, as a percent of the measured frequency, capped at OM_STEP_SPREAD_MASK.
+//The high bits are flags for steps that couldn't be measured properly and had a value filled in from somewhere else.
+#define OM_STEP_SPREAD_MASK 0x1F
+#define OM_STEP_NOT_MEASURED 0x20
+#define OM_STEP_SUBSTITUTED 0x40
+#define OM_STEP_TIMED_OUT 0x80
+
+//Steps with a spread above this percent are considered unstable, and are avoided when picking or correcting a resistance.
+#define OM_MAX_STABLE_STEP_SPREAD 5
+
+//This is the furthest in steps that will be searched for a stable step before settling for an unstable one.
+#define OM_STABLE_STEP_SEARCH_DISTANCE 3
 
 //Time to wait between receiving a note and starting to play that note (in ms).
 #define OM_NOTE_WAIT_TIME 3
 
-//this is to make sure frequency corrections are not too frequent (in ms):
-#define OM_TIME_BETWEEN_FREQ_CORRECTIONS 20
+//Frequency corrections are scheduled separately for each head, so high notes can be corrected often and low notes aren't corrected on stale data.
+//After a correction, the next one waits for this many periods of the note, and for at least OM_MIN_FRESH_READINGS new frequency readings.
+#define OM_CORRECTION_INTERVAL_PERIODS 8
+#define OM_MIN_FRESH_READINGS 1
+
+//Once the error is within this many times OM_ALLOWABLE_NOTE_ERROR, the note is nearly locked and the wait is multiplied by OM_NEAR_LOCK_INTERVAL_MULTIPLIER,
+//so small errors that are mostly noise aren't chased as hard as big ones.
+#define OM_NEAR_LOCK_ERROR_MULTIPLIER 3
+#define OM_NEAR_LOCK_INTERVAL_MULTIPLIER 2
+
+//These limit the time between frequency corrections (in us):
+#define OM_MIN_CORRECTION_INTERVAL 2000
+#define OM_MAX_CORRECTION_INTERVAL 60000
+
+//These are the places the pitch correction can be run from, for use with set_control_mode():
+//OM_CONTROL_IN_LOOP measures and corrects the frequency and updates the dither every time update() is called from the main loop.
+//OM_CONTROL_IN_TIMER leaves that to control_update(), which should be called for every head from a timer interrupt at a fixed rate.
+//update() then only handles the relay and servos, and new notes are handed to the interrupt through a mailbox instead of being set directly.
+#define OM_CONTROL_IN_LOOP 0
+#define OM_CONTROL_IN_TIMER 1
+
+//this controls the default control mode for each head
+#define OM_CONTROL_MODE_DEFAULT OM_CONTROL_IN_LOOP
+
+//These are the reasons a note can be dropped by pitch correction, for the OM_DEBUG messages printed by update():
+#define OM_DROP_BOTTOMED_OUT 0
+#define OM_DROP_TOPPED_OUT 1
+#define OM_DROP_PI_SATURATED 2
+
+//These are the pitch correction algorithms that can be used by adjust_freq(), for use with set_correction_mode():
+//OM_CORRECTION_STEP moves the resistance whenever the frequency is more than OM_ALLOWABLE_NOTE_ERROR off, by a number of steps based on the slope of measured_freqs.
+//OM_CORRECTION_PI runs a proportional-integral controller on the error, and sets the resistance to an offset from the one the note started at.
+#define OM_CORRECTION_STEP 0
+#define OM_CORRECTION_PI 1
 
-//this is a jitter value to randomize the resistance in an attempt to counter the frequency variation around a specific resistance value. it is measured in resistance steps
-#define OM_JITTER 1
+//this controls the default correction mode for each head
+#define OM_CORRECTION_MODE_DEFAULT OM_CORRECTION_STEP
+
+//These are the default PI controller gains. The error is in 1/1000ths of the desired inverted frequency, and the output is in 1/256ths of a resistance step.
+//So a proportional gain of 256 moves one whole step for every 0.1% of error, and the integral gain is added up once per correction.
+#define OM_PI_DEFAULT_KP 32
+#define OM_PI_DEFAULT_KI 32
+
+//This limits the integral term to this many resistance steps either way, so it can't wind up too far even away from the resistance limits.
+#define OM_PI_MAX_INTEGRAL_STEPS 64
+
+//When a correction is needed, the slope of measured_freqs around the current resistance is used to work out how many steps to move at once.
+//The slope is measured from this many steps below to this many steps above the current resistance.
+#define OM_CORRECTION_SLOPE_SPAN 4
+
+//This is the most steps that a single correction can move the resistance.
+#define OM_MAX_CORRECTION_STEPS 16
+
+//After the resistance changes, the analog oscillator takes a few cycles to settle at the new frequency.
+//Rising edges are ignored until at least this many periods have gone by, and for at least OM_SETTLING_TIME us. Set either to 0 to not use it.
+#define OM_SETTLING_PERIODS 3
+#define OM_SETTLING_TIME 500
+
+//The resistance can be set in fractions of a step. A sigma-delta modulator switches between the step and the one above it,
+//so that on average the resistance lands in between. This is the number of fractional bits, so 4 is 1/16 of a step.
+#define OM_DITHER_FRAC_BITS 4
+
+//This is how often the dither moves on, in us. Any fraction other than 0 writes a pot on most dither updates, so this is also the fastest
+//that the dither writes to the pots for each head, however often the control loop runs. At 250us that's up to 4000 16 bit writes a second
+//per head, which is about 24000 a second across six heads, or roughly 4% of the SPI bus at 10MHz.
+#define OM_DITHER_PERIOD 250
+
+//This is the number of resistance steps kept clear at each end of the range, so the dither always has a step above to switch to.
+#define OM_RESISTANCE_MARGIN 1
+
+//While a note is playing, confirmed readings are blended into measured_freqs with an exponential moving average, so the table follows the head as it drifts.
+//Each update moves the table entry 1/2^OM_LEARNING_SHIFT of the way to the reading.
+#define OM_LEARNING_SHIFT 3
+
+//A reading is only confirmed once two readings in a row at the same resistance agree to within this % of each other.
+#define OM_LEARNING_CONFIRM_SPREAD 1
+
+//This is the most that a single update can move a table entry, as a % of the entry, so a bad run of readings can't drag the table away.
+#define OM_LEARNING_MAX_CHANGE 1
+
+//This is the least time in ms between updates to the table for each head.
+#define OM_LEARNING_INTERVAL 50
+
+//Analog drift moves the whole curve of the head at once, so each head also keeps a running estimate of live = table*scale + offset across the whole table.
+//It's fitted to the table and live inverted frequencies at the first lock of each note, and used to pick the starting resistance and range for every new note.
+//Each lock moves the fit 1/2^OM_DRIFT_SHIFT of the way to the new point.
+#define OM_DRIFT_SHIFT 3
+
+//The scale is a fixed point number with this many fractional bits.
+#define OM_DRIFT_SCALE_FRAC_BITS 16
+
+//The locks need to be spread over at least this % of their average inverted frequency before the offset is fitted. Until then, only the scale is used.
+#define OM_DRIFT_MIN_SPREAD 10
+
+//This limits how far the estimate can move the table, as a % of the table inverted frequency.
+#define OM_DRIFT_MAX_CHANGE 15
 
 //This is the number of rising edges to read before computing a new current average frequency.
-#define OM_NUM_FREQ_READINGS 5
+//With interpolated edge timing each reading is accurate enough that a few less are needed, so notes get corrected sooner.
+//This can be at most PE_MAX_SAMPLES.
+#define OM_NUM_FREQ_READINGS 3
+
+//This is how the recent frequency readings are combined into one, either PE_MODE_MEAN, PE_MODE_MEDIAN or PE_MODE_TRIMMED_MEAN.
+//The median and trimmed mean ignore single glitchy readings, like the ones taken while a servo is moving.
+#define OM_FREQ_ESTIMATOR_MODE PE_MODE_MEDIAN
+
+//This is the number of readings thrown out from each end for PE_MODE_TRIMMED_MEAN.
+#define OM_FREQ_ESTIMATOR_TRIM 1
+
+//These are the ways the current frequency can be measured while a note is playing, for use with set_measurement_mode():
+//OM_MEASURE_AVERAGE combines the last OM_NUM_FREQ_READINGS edge to edge times using OM_FREQ_ESTIMATOR_MODE, and makes a new reading on every edge once it has enough.
+//OM_MEASURE_SPAN times the span from the first to the last of a run of valid edges and divides it by the number of periods in between.
+//The timing error of the edges in the middle cancels out, so the error is spread over the whole span instead of being added up for every period.
+//A period that is compromised (by a servo move, for example) is just left out of the span, so the periods already counted aren't thrown away.
+#define OM_MEASURE_AVERAGE 0
+#define OM_MEASURE_SPAN 1
+
+//this controls the default measurement mode for each head
+#define OM_MEASUREMENT_MODE_DEFAULT OM_MEASURE_SPAN
+
+//This is roughly how long each span measurement should take in us. The number of periods in a span is picked to fit this for each note.
+#define OM_SPAN_WINDOW 10000
+
+//These limit the number of periods in a span, for very low and very high notes:
+#define OM_MIN_SPAN_PERIODS 2
+#define OM_MAX_SPAN_PERIODS 64
 
 //This forces the init to run for OM_INIT_MULTIPLIER*OM_NUM_FREQ_READINGS of rising edges before taking the frequency reading on init.
 //Hopefully this will reduce or remove the need for the STABILIZATION_TIME startup testing.
-#define OM_INIT_MULTIPLIER 20
+//This is only the most that will be waited. A step is measured as soon as it has settled, see OM_CALIBRATION_SETTLED_READINGS.
+#define OM_INIT_MULTIPLIER 33
+
+//During the startup test, a step has settled once this many edge to edge times in a row are all within OM_CALIBRATION_SETTLED_TOLERANCE
+//of the first one, in 1/1000ths. Neighbouring steps are only a few 1/1000ths apart, so this needs to be tight to catch the oscillator still moving.
+#define OM_CALIBRATION_SETTLED_READINGS 4
+#define OM_CALIBRATION_SETTLED_TOLERANCE 3
 
 //This is how long to wait for initial frequency readings on init before declaring failure and marking the object as unavailable in ms.
 //if it sounds like things should be working, but it keeps timing out, you may need to increase this value.
 #define OM_TIME_TO_WAIT_FOR_INIT 2000
 
+//These are the states of the startup test. Each head runs it as a state machine, so all the heads can be tested at the same time.
+#define OM_CAL_IDLE 0
+#define OM_CAL_STABILIZING 1
+#define OM_CAL_WAITING_FOR_FIRST_EDGE 2
+#define OM_CAL_WARMING_UP 3
+#define OM_CAL_MEASURING 4
+#define OM_CAL_DONE 5
+#define OM_CAL_FAILED 6
+
+//These are the ways the startup test can go through the resistance steps, for use with set_calibration_mode():
+//OM_CALIBRATION_FULL measures every step.
+//OM_CALIBRATION_COARSE_TO_FINE measures every OM_CALIBRATION_COARSE_STEP steps first and fills in the rest by interpolation. It then goes back and measures
+//every step where the curve bends or the readings were noisy, and the steps on either side of every A440 MIDI note, since those are where notes start from.
+#define OM_CALIBRATION_FULL 0
+#define OM_CALIBRATION_COARSE_TO_FINE 1
+
+//this controls the default calibration mode for each head
+#define OM_CALIBRATION_MODE_DEFAULT OM_CALIBRATION_COARSE_TO_FINE
+
+//This is the distance between the steps measured on the coarse pass of OM_CALIBRATION_COARSE_TO_FINE.
+#define OM_CALIBRATION_COARSE_STEP 8
+
+//If a coarse step is more than this % off of the straight line between the coarse steps on either side of it, the curve bends there
+//and all the steps on both sides of it are measured on the fine pass.
+#define OM_CALIBRATION_MAX_BEND 2
+
+//When stored startup test results are loaded, this many reference steps spread across the table are measured to check them before they are used.
+#define OM_VERIFY_NUM_POINTS 8
+
+//If every reference step is within this many 1/1000ths of the stored table, the table is used as it is.
+//If they aren't, but they are all this close to a straight line fit from the table to what was measured, the whole table has just shifted,
+//and it is corrected with the fit. Any reference steps that still aren't this close have the steps between their neighbours measured again.
+#define OM_VERIFY_ALLOWABLE_ERROR 10
+
+//If any reference step is more than this many 1/1000ths off of the stored table, or more than OM_VERIFY_MAX_BAD_POINTS of them don't fit,
+//the stored table isn't trusted at all and the full startup test is run instead.
+#define OM_VERIFY_MAX_ERROR 100
+#define OM_VERIFY_MAX_BAD_POINTS 3
+
 //THis is how long to play an initial note before the startup_test sets MIDI_freqs. in ms
 #define OM_TIME_TO_WAIT_FOR_STARTUP_TEST_SOUND 100
 
@@ -184,17 +392,42 @@ Copyright 2019 - kiyoshigawa - tim@twa.ninja
 //This is how often servo updates can be sent in us. (About 60Hz)
 #define OM_MIN_TIME_BETWEEN_SERVO_MOVEMENTS 16
 
+//This is an inverted frequency in us as a fixed point number with OM_PERIOD_FRAC_BITS fractional bits.
+//All the frequency measurement and correction math inside the class is done with these, so the sub-us precision
+//of the cycle counter timestamps isn't thrown away before it gets used. The public functions still take whole us.
+typedef uint32_t om_period_t;
+
 class oMIDItone {
 	public:
 		//constructor function
-		oMIDItone(uint16_t signal_enable_optoisolator, uint16_t speaker_disable_optoisolator, uint16_t cs1, uint16_t cs2, uint16_t feedback, uint16_t servo_l_channel, uint16_t servo_r_channel, uint16_t servo_l_min, uint16_t servo_l_max, uint16_t servo_r_min, uint16_t servo_r_max, uint16_t led_head_array[OM_NUM_LEDS_PER_HEAD], Animation * head_animation);
+		//The period_backend finds the rising edges on the feedback pin. Each head needs its own.
+		//The pot_queue sends the digital pot writes, and is shared by all the heads. The cs1 and cs2 pins are added to it here.
+		oMIDItone(uint16_t signal_enable_optoisolator, uint16_t speaker_disable_optoisolator, uint16_t cs1, uint16_t cs2, uint16_t feedback, uint16_t servo_l_channel, uint16_t servo_r_channel, uint16_t servo_l_min, uint16_t servo_l_max, uint16_t servo_r_min, uint16_t servo_r_max, uint16_t led_head_array[OM_NUM_LEDS_PER_HEAD], Animation * head_animation, PeriodBackend * period_backend, PotQueue * pot_queue);
 
 		//this will init the pin modes and set up Serial if it's not already running.
-		void init(void);
+		//It runs the whole startup test before returning, which takes a while. To test several heads at once, use start_init() and update_init() instead.
+		//If use_stored_calibration is true and a calibration slot has been set, the results saved by the last startup test are loaded instead when they are there.
+		void init(bool use_stored_calibration = true);
+
+		//This does the same setup as init(), but only starts the startup test. If the stored results are loaded, only a quick check of them is run,
+		//unless it finds they are too far off. See OM_VERIFY_NUM_POINTS.
+		void start_init(bool use_stored_calibration = true);
+
+		//This runs the startup test a little further, and returns true until it is finished.
+		//It doesn't wait for anything, so it can be called for every head in turn in the same loop to test them all at the same time.
+		bool update_init(void);
 
 		//This should be called during the loop, and it will update the note frequencies and play notes as needed.
 		void update(void);
 
+		//In OM_CONTROL_IN_TIMER mode, this should be called from a timer interrupt at a fixed rate. It picks up new notes,
+		//measures and corrects the frequency, and updates the dither. It does nothing in OM_CONTROL_IN_LOOP mode.
+		void control_update(void);
+
+		//this sets where the pitch correction for this head runs from, either OM_CONTROL_IN_LOOP or OM_CONTROL_IN_TIMER.
+		//The timer calling control_update() should not be running while this is changed.
+		void set_control_mode(uint8_t mode);
+
 		//This will tell the oMIDItone to play at a frequency. The frequency will continue to play until changed or until sound is set to off.
 		//If the note is out of the oMIDItone range, it will not play anything and return false
 		//if the note can be played, it will begin playing immediately and return true
@@ -232,21 +465,126 @@ class oMIDItone {
 		void enable_servos(void);
 		void disable_servos(void);
 
+		//these enable and disable blending confirmed readings into measured_freqs while notes are playing:
+		void enable_calibration_learning(void);
+		void disable_calibration_learning(void);
+
+		//this returns the number of times measured_freqs has been updated from readings since init.
+		uint32_t calibration_update_count(void);
+
+		//this forgets the drift estimate, so the table is used as it was measured.
+		void reset_drift_estimate(void);
+
+		//this sets the pitch correction algorithm for this head, either OM_CORRECTION_STEP or OM_CORRECTION_PI.
+		void set_correction_mode(uint8_t mode);
+
+		//this sets the EEPROM slot this head's startup test results are saved in, from 0 to CS_MAX_SLOTS-1. Every head needs a different one.
+		//It should be called before init(). Without one, the startup test runs every time and nothing is saved.
+		void set_calibration_slot(uint8_t slot);
+
+		//this sets how the startup test goes through the resistance steps, either OM_CALIBRATION_FULL or OM_CALIBRATION_COARSE_TO_FINE.
+		//It takes effect the next time the startup test runs.
+		void set_calibration_mode(uint8_t mode);
+
+		//this sets the PI controller gains for this head. See OM_PI_DEFAULT_KP for the units.
+		void set_pi_gains(int16_t kp, int16_t ki);
+
+		//this sets how rising edges are timestamped for this head, either PB_EDGE_TIMING_RAW or PB_EDGE_TIMING_INTERPOLATED.
+		//It only makes a difference for backends that find edges in sampled data.
+		//The current frequency readings are thrown out when it is changed, since they were timed the old way.
+		void set_edge_timing(uint8_t mode);
+
+		//this sets how the current frequency is measured for this head, either OM_MEASURE_AVERAGE or OM_MEASURE_SPAN.
+		void set_measurement_mode(uint8_t mode);
+
 		//this will return true once if a note has been dropped due to pitch correction since the last time it was run:
 		bool note_was_dropped(void);
 
+		//this sets how long rising edges are ignored after the resistance changes, in periods and in us. Both have to pass before readings are used.
+		void set_settling_window(uint8_t periods, uint32_t time);
+
+		//This returns the quality byte saved for a resistance step during the startup test. See OM_STEP_SPREAD_MASK.
+		uint8_t step_quality(uint16_t resistance);
+
+		//these return the number of frequency readings that have been thrown out while a note was playing,
+		//either because the oscillator was still settling after a resistance change, or because they were out of the valid range.
+		uint32_t settling_rejected_count(void);
+		uint32_t range_rejected_count(void);
+
 		//this stores the lighting animation info for the head:
 		Animation * animation;
 
 	private:
-		//This will play from 0 resistance value to 512 resistance value and note which resistances
-		//correspond to which notes in the note matrix:
-		//Returns true if init was successful and false if it was not.
-		bool startup_test(void);
+		//This will start the startup test, which will play from 0 resistance value to 768 resistance value and note which resistances
+		//correspond to which notes in the note matrix. The test is run by startup_test_update().
+		void start_startup_test(void);
+
+		//This does whatever the startup test is waiting to do next, without waiting. It returns false once the test is done or has failed.
+		bool startup_test_update(void);
+
+		//This sets up the startup test to measure a resistance step.
+		void start_startup_test_step(uint16_t resistance);
+
+		//This saves the frequency and quality for the step that freq_estimator has just filled up with readings.
+		//It returns false if the frequency is too high to keep going, after filling in the rest of the steps.
+		bool save_startup_test_step(void);
+
+		//This moves the startup test on to the next resistance step, or finishes it after the last one.
+		void next_startup_test_step(void);
+
+		//This works out the playable range from measured_freqs once all the steps have been measured, and sets had_successful_init.
+		//If it worked, the results are saved to the calibration slot.
+		void finish_startup_test(void);
+
+		//This loads measured_freqs and the playable range from the calibration slot in place of the startup test, and returns true if they were there.
+		bool load_calibration(void);
+
+		//These measure the reference steps to check the loaded table against, in place of the startup test. See OM_VERIFY_NUM_POINTS.
+		void start_verification(void);
+		void next_verification_step(void);
+
+		//Once the reference steps are measured, this uses the table, corrects it, measures the parts of it that are off again, or runs the whole startup test.
+		void finish_verification(void);
+
+		//This fits a straight line from the table to the measured reference steps, and puts it in drift_scale and drift_offset. Returns false if it can't be fit.
+		bool fit_verification_points(void);
+
+		//This returns the closest step below resistance that has been measured in the current startup test, to compare new readings to.
+		uint16_t previous_measured_step(uint16_t resistance);
+
+		//This fills in every step up to calibration_top that hasn't been measured by interpolating between the measured steps on either side.
+		//If is_final is true, the filled in steps are marked as measured, with the larger spread of the two steps they came from.
+		void interpolate_unmeasured_steps(bool is_final);
+
+		//After the coarse pass, this picks the steps to measure on the fine pass. See OM_CALIBRATION_COARSE_TO_FINE.
+		void plan_fine_steps(void);
+
+		//These mark every unmeasured step from first to last to be measured on the fine pass, and find the next one that is.
+		void mark_fine_steps(uint16_t first, uint16_t last);
+		uint16_t next_fine_step(uint16_t resistance);
 
 		//this will change the resistance value and set the current_desired_freq for pitch correction to the frequency in the argument.
 		//do not call without making sure the frequency is playable first
-		void set_freq(uint32_t freq);
+		void set_freq(om_period_t freq);
+
+		//This sets a new frequency to play, or OM_NO_FREQ to stop. In OM_CONTROL_IN_LOOP mode it happens right away,
+		//and in OM_CONTROL_IN_TIMER mode it is left in the mailbox for control_update() to pick up.
+		void request_freq(om_period_t freq);
+
+		//This is the part of update() that measures and corrects the frequency and updates the dither.
+		void correction_update(void);
+
+		//This returns the frequency the head is about to be playing: the one waiting in the mailbox if control_update() hasn't picked it up yet,
+		//or current_desired_freq if not. From the main loop it should be called with interrupts off, so the two can't change part way through.
+		om_period_t latest_desired_freq(void);
+
+		//This is the same as can_play_freq(), but for an inverted frequency that has already been converted to an om_period_t.
+		//It doesn't stop the control interrupt, so from the main loop it should be called with interrupts off.
+		bool can_play_period(om_period_t freq);
+
+		//This prints an OM_DEBUG message for the last note dropped by pitch correction, if it hasn't been printed yet.
+		//The pitch correction can be running in the control interrupt, so it only saves the details for this to print later from update().
+		void print_dropped_note(void);
 
 		//this takes the frequency averaging code and puts it into a function to clean up the update function:
 		void measure_freq(void);
@@ -254,70 +592,258 @@ class oMIDItone {
 		//This is a function that will change the current_resistance to a different value if it is too far off from the current_frequency.
 		void adjust_freq(void);
 
+		//This is the OM_CORRECTION_PI version of adjust_freq(). It is called from adjust_freq() once it's time for a correction.
+		void pi_adjust_freq(void);
+
+		//This resets the correction timer and picks how long to wait before the next correction, based on the note's period and the current error.
+		void schedule_next_correction(void);
+
+		//This returns how many resistance steps the next correction should move, based on how far current_freq is from current_desired_freq
+		//and the slope of measured_freqs around current_resistance. It is always between 1 and OM_MAX_CORRECTION_STEPS.
+		uint16_t correction_step_size(void);
+
+		//This blends current_freq into the measured_freqs entries for the current resistance, if it has been confirmed by the reading before it.
+		//The change is rate limited and kept between the neighbouring entries, so the table always stays in order.
+		void learn_measured_freq(void);
+
+		//This moves a measured_freqs entry by change, limited to OM_LEARNING_MAX_CHANGE and to the entries on either side.
+		void nudge_measured_freq(uint16_t resistance, int32_t change);
+
+		//This returns the table inverted frequency at a fraction of the way from resistance to resistance+1, in 1/2^OM_DITHER_FRAC_BITS steps.
+		om_period_t table_freq_at(uint16_t resistance, uint8_t fraction);
+
+		//These convert between inverted frequencies in the calibration table and live inverted frequencies using the drift estimate.
+		om_period_t table_to_live_freq(om_period_t freq);
+		om_period_t live_to_table_freq(om_period_t freq);
+
+		//This adds the current lock to the drift estimate and updates drift_scale and drift_offset.
+		void update_drift_estimate(void);
+
 		//This function will open and close the mouth based on the current note valocity
 		void servo_update(void);
 
-		//This will constantly read the analog input and return true when it detects a rising edge signal.
-		//It also updates the current and last rising edge time values.
+		//This returns true if the most recent rising edge came too soon after a resistance change to be trusted.
+		//It counts down the settling periods, so it should be called once for each edge.
+		bool is_settling(void);
+
+		//This will return true when the backend has a new rising edge for the head.
+		//It also updates the rising_edge_period and last_rising_edge_time values.
 		bool is_rising_edge(void);
 
-		//a simple averaging function:
-		uint32_t average(unsigned long * array, uint16_t num_elements);
+		//This returns the time in CPU cycles since the last rising edge was detected.
+		uint32_t time_since_rising_edge(void);
 
 		//this function will find a resistance value that was measured as being very near the desired frequency.
-		uint16_t freq_to_resistance(uint16_t freq);
+		//It will move to a nearby stable step if the closest one was unstable.
+		uint16_t freq_to_resistance(om_period_t freq);
+
+		//This returns the first step from low up to (but not including) high with a table inverted frequency below freq, or high if there isn't one.
+		//measured_freqs is kept in order, so this is a binary search.
+		uint16_t first_step_below(om_period_t freq, uint16_t low, uint16_t high);
+
+		//This makes sure measured_freqs never goes up as the resistance goes up, flagging any steps that had to be changed as substituted.
+		void make_measured_freqs_monotonic(void);
+
+		//This works out the first step below each A440 MIDI note in measured_freqs, for freq_to_resistance() to start from.
+		//It needs to be called whenever measured_freqs changes.
+		void rebuild_note_cache(void);
 
-		//this introduces jittered resistance settings, and should be called every loop to keep the jitter working:
-		void set_jitter_resistance(uint16_t resistance, uint16_t jitter);
+		//This is the same as rebuild_note_cache(), but only for the notes that can have moved when the steps from first to last were changed.
+		//Learning calls it from the pitch correction, which can be in the control interrupt, so it only searches the few steps that changed.
+		void update_note_cache(uint16_t first, uint16_t last);
+
+		//This returns true if a resistance step was measured properly and its readings were stable during the startup test.
+		bool step_is_stable(uint16_t resistance);
+
+		//This moves from a resistance step in direction (+1 or -1) until it finds a stable step, up to OM_STABLE_STEP_SEARCH_DISTANCE steps.
+		//If there aren't any, it returns the resistance it started at.
+		uint16_t skip_unstable_steps(uint16_t resistance, int8_t direction);
+
+		//this sets the resistance to a fraction of the way from resistance to resistance+1, in 1/2^OM_DITHER_FRAC_BITS steps.
+		//It should be called every loop to keep the dither working. The dither moves on once every OM_DITHER_PERIOD, and the pots are only written when the dithered step changes.
+		void set_dithered_resistance(uint16_t resistance, uint8_t fraction);
 
 		//this will take a uint16_t number and set the total resistance value to between 0 and 767 on the board.
 		void set_resistance(uint16_t resistance);
 
-		//this will set the CS_pin digital pot's wiper to a value based on byte 1 and byte 2
-		void set_pot(uint16_t CS_pin, uint16_t command_byte);
+		//this will queue new wiper values for both digital pots, skipping any pot that is already set to its value. It returns right away.
+		void set_pots(uint16_t pot1_value, uint16_t pot2_value);
 
 		//This will be set to true if the startup_test was successful:
 		bool had_successful_init;
 
+		//this is the state of the startup test, one of the OM_CAL_ states.
+		uint8_t calibration_state;
+
+		//this is the number of rising edges seen so far while warming up the current startup test step.
+		uint16_t calibration_edges;
+
+		//this is the first edge to edge time in the current run of agreeing times while warming up, and the number of times that agreed with it.
+		om_period_t calibration_settle_period;
+		uint8_t calibration_settled_readings;
+
+		//this is the calibration mode set by set_calibration_mode()
+		uint8_t calibration_mode;
+
+		//this is true once the coarse pass of OM_CALIBRATION_COARSE_TO_FINE is done.
+		bool calibration_is_fine_pass;
+
+		//this is the highest step the startup test will measure. It is lowered if the frequency gets too high to measure first.
+		uint16_t calibration_top;
+
+		//this has one bit for every step that still needs to be measured on the fine pass.
+		uint8_t fine_steps[OM_NUM_RESISTANCE_STEPS/8];
+
+		//this is true while the loaded table is being checked against the reference steps.
+		bool calibration_is_verify_pass;
+
+		//these are the reference steps for checking the loaded table, what was measured at each one, and the one being measured now.
+		uint16_t verify_steps[OM_VERIFY_NUM_POINTS];
+		om_period_t verify_freqs[OM_VERIFY_NUM_POINTS];
+		uint8_t verify_index;
+
 		//this is a variable that controls whether or not frequency correction is enabled:
 		bool pitch_correction_is_enabled;
 
 		//this is a variable that controls whether or not servos are enabled
 		bool servo_is_enabled;
 
+		//this is a variable that controls whether or not measured_freqs is updated while notes are playing
+		bool calibration_learning_is_enabled;
+
+		//this is the previous reading and the fractional resistance it was taken at, to confirm the next one against.
+		om_period_t learning_candidate_freq;
+		uint16_t learning_candidate_resistance;
+
+		//this counts the updates to measured_freqs, for calibration_update_count()
+		uint32_t calibration_updates;
+
+		//this is the current drift estimate, with drift_scale in 1/2^OM_DRIFT_SCALE_FRAC_BITS.
+		volatile int32_t drift_scale;
+		volatile int32_t drift_offset;
+
+		//these are the running averages that the drift estimate is fitted from: the table and live inverted frequencies, and their variance and covariance.
+		int32_t drift_mean_table;
+		int32_t drift_mean_live;
+		int64_t drift_variance;
+		int64_t drift_covariance;
+
+		//this is the number of locks that have gone into the drift estimate.
+		uint32_t drift_num_locks;
+
+		//this is true once the current note has locked and been added to the drift estimate.
+		bool drift_lock_recorded;
+
+		//this is the measurement mode set by set_measurement_mode()
+		uint8_t measurement_mode;
+
+		//this is the correction mode set by set_correction_mode()
+		uint8_t correction_mode;
+
+		//these are the PI controller gains set by set_pi_gains()
+		int16_t pi_kp;
+		int16_t pi_ki;
+
+		//this is the resistance the current note started at in 1/2^OM_DITHER_FRAC_BITS steps, which the PI controller's output is added to.
+		uint16_t pi_base_resistance;
+
+		//this is the PI controller's integral term, in 1/256ths of a resistance step.
+		int32_t pi_integral;
+
 		//this will be set during the startup test to the lowest inverted frequency registered.
-		uint32_t smallest_freq;
+		//It and largest_freq are in table inverted frequencies, before the drift estimate is applied.
+		volatile om_period_t smallest_freq;
 
 		//this will be set during the startup test to the highest inverted frequency registered.
-		uint32_t largest_freq;
+		volatile om_period_t largest_freq;
+
+		//this is an array of the most recent measured rising edge average times that correspond to a resistance
+		//Updates while playing are converted back through the drift estimate, so the table stays in the same terms as it was measured in.
+		om_period_t measured_freqs[OM_NUM_RESISTANCE_STEPS];
+
+		//this is the first step in measured_freqs below each A440 MIDI note's inverted frequency, from rebuild_note_cache()
+		uint16_t note_resistance_cache[MIDI_NUM_NOTES];
+
+		//this is the quality of the measurement at each resistance step in measured_freqs
+		uint8_t measured_quality[OM_NUM_RESISTANCE_STEPS];
 
-		//this is an array of the most recent measured rising edge average times in us that correspond to a resistance
-		uint32_t measured_freqs[OM_NUM_RESISTANCE_STEPS];
+		//This keeps the last OM_NUM_FREQ_READINGS edge to edge times, and combines them into a frequency reading.
+		PeriodEstimator freq_estimator;
 
-		//This is an array of the last OM_NUM_FREQ_READINGS frequency readings for averaging purposes.
-		uint32_t recent_freqs[OM_NUM_FREQ_READINGS];
+		//this is the CPU cycle count of the rising edge that started the current span measurement.
+		//It is moved forward by the length of any period left out of the span, so the time from here to the last edge only covers the counted periods.
+		uint32_t span_start_time;
 
-		//this is an index that will count up to OM_NUM_FREQ_READINGS and reset to 0, triggering a frequency measurement average.
-		uint16_t freq_reading_index;
+		//this is the number of valid periods since span_start_time.
+		uint16_t span_num_periods;
 
-		//This is a variable for storing the most recent frequency reading based on the average of the last OM_NUM_FREQ_READINGS readings
-		uint32_t current_freq;
+		//this is the number of periods to measure in each span for the current note, based on OM_SPAN_WINDOW.
+		uint16_t span_target_periods;
+
+		//This is a variable for storing the most recent frequency reading from freq_estimator or the current span
+		om_period_t current_freq;
 
 		//this is a variable that stores the current desired frequency set by the play_freq() or change_freq() functions
 		//it cuts down on calculating it every time, since pitch bend uses floating point math, which is much slower than the rest of the code
-		uint32_t current_desired_freq;
-
-		//this is a variable for globally storing the most recent analog reading
-		uint16_t last_analog_read;
+		//it is volatile because the control interrupt sets it to OM_NO_FREQ when a note is dropped.
+		volatile om_period_t current_desired_freq;
 
 		//variable for saving the current resistance value of the digital pots.
 		uint16_t current_resistance;
 
 		//this is used to cancel a pitch correction if an event occurs that would disturb the timing
-		bool pitch_correction_has_been_compromised;
+		volatile bool pitch_correction_has_been_compromised;
+
+		//this counts the notes dropped by pitch correction. note_was_dropped() compares it to the count it saw last time,
+		//so it can be added to from the control interrupt without needing to be cleared by the main loop.
+		volatile uint32_t notes_dropped;
+		uint32_t notes_dropped_seen;
+
+		//these are the inverted frequency and OM_DROP_* reason for the last dropped note, and the notes_dropped count print_dropped_note() has printed up to.
+		volatile om_period_t dropped_note_freq;
+		volatile uint8_t dropped_note_reason;
+		uint32_t notes_dropped_printed;
+
+		//this is the control mode set by set_control_mode()
+		uint8_t control_mode;
+
+		//this is the mailbox for handing new notes to control_update(). The main loop writes the frequency and then bumps the sequence number,
+		//and control_update() plays the frequency whenever the sequence number is different from the last one it played.
+		volatile om_period_t requested_freq;
+		volatile uint32_t request_sequence;
+		volatile uint32_t applied_request_sequence;
+
+		//this is the fractional part of the resistance to play, in 1/2^OM_DITHER_FRAC_BITS steps, to go with current_resistance.
+		uint8_t resistance_fraction;
+
+		//this is the sigma-delta modulator's running total of fractions that haven't been played yet.
+		uint8_t dither_accumulator;
+
+		//this is true while the dither is playing the step above the resistance, until the next dither update.
+		bool dither_is_high;
 
-		//this lets things outside the class know if a pitch correction action caused a note to be dropped.
-		bool new_note_dropped;
+		//this is the last whole resistance step that was sent to the digital pots.
+		uint16_t last_written_resistance;
+
+		//this is the fractional resistance that the dither was last set to, to tell when it changes.
+		uint16_t last_set_resistance;
+
+		//this is true from when the resistance changes until the settling window has passed.
+		bool resistance_is_settling;
+
+		//this is the backend time when the resistance last changed.
+		uint32_t resistance_change_time;
+
+		//this is the number of rising edges left to ignore since the resistance last changed.
+		uint8_t settling_periods_left;
+
+		//these are the settling window settings from set_settling_window(), with the time in CPU cycles.
+		uint8_t settling_periods;
+		uint32_t settling_cycles;
+
+		//these count the readings thrown out, for settling_rejected_count() and range_rejected_count()
+		uint32_t settling_rejected_readings;
+		uint32_t range_rejected_readings;
 
 		//pin number tracking:
 		uint16_t signal_enable_optoisolator_pin;
@@ -326,8 +852,20 @@ class oMIDItone {
 		uint16_t cs2_pin;
 		uint16_t analog_feedback_pin;
 
-		//set up an instanced ADC object for use in the code.
-		ADC *adc = new ADC();
+		//This is the queue that sends the digital pot writes, and the chip numbers of this head's pots in it.
+		PotQueue * pots;
+		uint8_t pot1_chip;
+		uint8_t pot2_chip;
+
+		//this is the last wiper value queued for each digital pot, or OM_POT_UNKNOWN.
+		uint16_t last_pot1_value;
+		uint16_t last_pot2_value;
+
+		//This is the backend that finds the rising edges on the feedback pin.
+		PeriodBackend * backend;
+
+		//This is where the startup test results are saved, set up by set_calibration_slot().
+		CalibrationStore calibration_store;
 
 		//Servo channels - these are the channel for the left and right servo for this head on the servo controller
 		uint16_t l_channel;
@@ -345,11 +883,26 @@ class oMIDItone {
 		//this stores the order of the led positions on the lighting controller that correspond to the oMIDItone head.
 		uint16_t * led_position_array;
 		
-		//this is to measure the frequency of rising edges produced by the output sound wave
-		elapsedMicros last_rising_edge;
+		//this is the CPU cycle count when the most recent rising edge was detected, on the backend's time base.
+		uint32_t last_rising_edge_time;
 
-		//this is to make sure the frequency correction isn't happening faster than the digital pots can be set
-		elapsedMillis last_adjust_time;
+		//this is the CPU cycle count of the rising edge before that one, so a single period can be left out of a span.
+		uint32_t previous_rising_edge_time;
+
+		//this is the time between the two most recent rising edges produced by the output sound wave
+		om_period_t rising_edge_period;
+
+		//this is the time since the last frequency correction, in us.
+		elapsedMicros last_adjust_time;
+
+		//this is the time since the dither last moved on, in us. See OM_DITHER_PERIOD.
+		elapsedMicros last_dither_time;
+
+		//this is the time in us to wait after the last correction before the next one, from schedule_next_correction().
+		uint32_t correction_interval;
+
+		//this is the number of frequency readings that have been made since the last correction.
+		uint16_t readings_since_correction;
 
 		//this is to make sure the frequency correction isn't happening faster than the digital pots can be set
 		elapsedMillis last_stabilize_time;
@@ -363,6 +916,12 @@ class oMIDItone {
 		//this is to allow the oMIDItone to play a note for a bit before it sets the initial MIDI_freqs
 		elapsedMillis last_freq_measurement;
 
+		//this is the time since the startup test started looking for rising edges, for the timeouts in the startup test.
+		elapsedMillis startup_start_time;
+
+		//This is the time since measured_freqs was last updated from a reading.
+		elapsedMillis last_learning_time;
+
 		//This tracks when the previous servo update ran on this head
 		elapsedMillis last_servo_update;
 };
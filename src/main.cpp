@@ -110,6 +110,9 @@ Copyright 2019 - kiyoshigawa - tim@twa.ninja
 #include <colors.h>
 #include <lighting_control.h>
 #include <MIDIController.h>
+#include <FeedbackSampler.h>
+#include <ADCPeriodBackend.h>
+#include <PotQueue.h>
 #include <oMIDItone.h>
 
 //this will print messages on system startup and init
@@ -118,6 +121,16 @@ Copyright 2019 - kiyoshigawa - tim@twa.ninja
 //This will turn on/off the debug note messages when notes are added or removed via MIDI
 //#define NOTE_DEBUG
 
+//uncomment this to run the pitch correction for all heads from a timer interrupt at a fixed rate instead of from the main loop.
+//The main loop is then left with MIDI, note assignment and lighting, and a slow lighting update can't hold up the pitch correction.
+//#define CONTROL_LOOP_IN_TIMER
+
+//This is how often the timer runs the pitch correction for all heads, in Hz.
+#define CONTROL_LOOP_RATE 4000
+
+//This is the priority of the control loop timer interrupt. Higher numbers are lower priority, so USB and the pot queue can still interrupt it.
+#define CONTROL_LOOP_PRIORITY 192
+
 //defines to make the head selection code more readable:
 #define AVAILABLE true
 #define NOT_AVAILABLE false
@@ -331,6 +344,24 @@ elapsedMicros last_lighting_update;
 
 //Using SPI0 on board, MOSI0 = 11, MISO0 = 12, and SCK0 = 13, which will blink the LED as it sends.
 
+//this sends the digital pot writes for all the heads in the background.
+//it needs to be declared before the oMIDItone objects so it exists when they add their pots.
+PotQueue pq = PotQueue();
+
+//this samples all six feedback pins in the background, and is shared by the period backends below.
+//it needs to be declared before them so it exists when they register their feedback pins.
+FeedbackSampler fs = FeedbackSampler();
+
+//these find the rising edges on each head's feedback pin from the shared sampler's readings:
+ADCPeriodBackend om_backends[OM_NUM_OMIDITONES] = {
+	ADCPeriodBackend(&fs, om1_analog_feedback_pin),
+	ADCPeriodBackend(&fs, om2_analog_feedback_pin),
+	ADCPeriodBackend(&fs, om3_analog_feedback_pin),
+	ADCPeriodBackend(&fs, om4_analog_feedback_pin),
+	ADCPeriodBackend(&fs, om5_analog_feedback_pin),
+	ADCPeriodBackend(&fs, om6_analog_feedback_pin),
+};
+
 //declare the oMIDItone objects:
 oMIDItone oms[OM_NUM_OMIDITONES] = {
 	oMIDItone(	
@@ -346,7 +377,9 @@ oMIDItone oms[OM_NUM_OMIDITONES] = {
 		om1_r_min, 
 		om1_r_max, 
 		om1_leds, 
-		&om1_animation),
+		&om1_animation, 
+		&om_backends[0],
+		&pq),
 	oMIDItone(
 		om2_se_pin, 
 		om2_sd_pin, 
@@ -360,7 +393,9 @@ oMIDItone oms[OM_NUM_OMIDITONES] = {
 		om2_r_min, 
 		om2_r_max, 
 		om2_leds, 
-		&om2_animation),
+		&om2_animation, 
+		&om_backends[1],
+		&pq),
 	oMIDItone(
 		om3_se_pin, 
 		om3_sd_pin, 
@@ -374,7 +409,9 @@ oMIDItone oms[OM_NUM_OMIDITONES] = {
 		om3_r_min, 
 		om3_r_max, 
 		om3_leds, 
-		&om3_animation),
+		&om3_animation, 
+		&om_backends[2],
+		&pq),
 	oMIDItone(
 		om4_se_pin, 
 		om4_sd_pin, 
@@ -388,7 +425,9 @@ oMIDItone oms[OM_NUM_OMIDITONES] = {
 		om4_r_min, 
 		om4_r_max, 
 		om4_leds, 
-		&om4_animation),
+		&om4_animation, 
+		&om_backends[3],
+		&pq),
 	oMIDItone(
 		om5_se_pin, 
 		om5_sd_pin, 
@@ -402,7 +441,9 @@ oMIDItone oms[OM_NUM_OMIDITONES] = {
 		om5_r_min, 
 		om5_r_max, 
 		om5_leds, 
-		&om5_animation),
+		&om5_animation, 
+		&om_backends[4],
+		&pq),
 	oMIDItone(
 		om6_se_pin, 
 		om6_sd_pin, 
@@ -416,9 +457,62 @@ oMIDItone oms[OM_NUM_OMIDITONES] = {
 		om6_r_min, 
 		om6_r_max, 
 		om6_leds, 
-		&om6_animation),
+		&om6_animation, 
+		&om_backends[5],
+		&pq),
 };
 
+#ifdef CONTROL_LOOP_IN_TIMER
+	//this runs the pitch correction for all the heads at CONTROL_LOOP_RATE:
+	IntervalTimer control_loop_timer;
+
+	void control_loop_isr(void)
+	{
+		for(int h=0; h<OM_NUM_OMIDITONES; h++){
+			oms[h].control_update();
+		}
+	}
+#endif
+
+//this runs the startup test on all the heads at the same time.
+//The lighting isn't updated while it runs, since sending to the LED strip holds off interrupts long enough to upset the edge timing.
+//If use_stored_calibration is true, heads with results saved in the EEPROM skip the test and are ready right away.
+void init_oMIDItones(bool use_stored_calibration)
+{
+	for(int h=0; h<OM_NUM_OMIDITONES; h++){
+		oms[h].start_init(use_stored_calibration);
+	}
+	bool heads_are_testing = true;
+	while(heads_are_testing){
+		heads_are_testing = false;
+		for(int h=0; h<OM_NUM_OMIDITONES; h++){
+			if(oms[h].update_init()){
+				heads_are_testing = true;
+			}
+		}
+	}
+}
+
+//this hands the pitch correction over to the control loop timer when CONTROL_LOOP_IN_TIMER is defined:
+void start_control_loop(void)
+{
+	#ifdef CONTROL_LOOP_IN_TIMER
+		for(int h=0; h<OM_NUM_OMIDITONES; h++){
+			oms[h].set_control_mode(OM_CONTROL_IN_TIMER);
+		}
+		control_loop_timer.priority(CONTROL_LOOP_PRIORITY);
+		control_loop_timer.begin(control_loop_isr, 1000000/CONTROL_LOOP_RATE);
+	#endif
+}
+
+//this stops the control loop timer, so that the heads can be re-initialized from the main loop:
+void stop_control_loop(void)
+{
+	#ifdef CONTROL_LOOP_IN_TIMER
+		control_loop_timer.end();
+	#endif
+}
+
 //a quick check to make sure a number corresponds to a valid rainbow in the rb_array
 //if the number is larger than the num_rainbows, it returns 0, otherwise it returns value
 uint8_t validate_rainbow_number(uint8_t value)
@@ -820,10 +914,11 @@ void update_oMIDItones(void)
 {
 	//check to see if a tune request was received. If so, call the init function for the heads
 	//this will take a while, so don't automate it into your MIDI files plsthx
+	//The stored results are ignored so the heads are measured again, and the new results are saved over them.
 	if(mc.tune_request_was_received()){
-		for(int i=0; i<OM_NUM_OMIDITONES; i++){
-			oms[i].init();
-		}
+		stop_control_loop();
+		init_oMIDItones(false);
+		start_control_loop();
 	}
 
 	//check to see if a system reset request was received. This will reset the entire teensy,
@@ -989,10 +1084,16 @@ void setup(void)
 		head_order_array[h] = h;
 		pending_head_order_array[h] = h;
 		lc.add_animation(oms[h].animation);
-		//init the om objects - This is going to take a while - like several minutes:
-		oms[h].init();
-		lc.update();
+		//each head saves its startup test results in its own EEPROM slot:
+		oms[h].set_calibration_slot(h);
 	}
+	//init the om objects - This is going to take a while the first time, but all the heads are tested at the same time.
+	//After that, the results saved in the EEPROM are loaded and quickly checked instead, and only measured again where they are off.
+	//Send a tune request to measure everything again.
+	init_oMIDItones(true);
+
+	//now that the heads are ready, start the control loop timer if it's being used:
+	start_control_loop();
 
 	//initialize the MIDIController:
 	mc.init();
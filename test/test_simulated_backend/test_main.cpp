@@ -0,0 +1,117 @@
+/*
+These are host tests for SimulatedPeriodBackend. They only use it through the
+PeriodBackend interface, the same way an oMIDItone head does, to make sure the
+simulated edges behave the way the pitch correction expects real ones to.
+
+Run them with `pio test -e native`.
+
+Copyright 2019 - kiyoshigawa - tim@twa.ninja
+*/
+
+/*
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unity.h>
+#include <SimulatedPeriodBackend.h>
+
+//This is how many edges each test reads.
+#define TEST_NUM_EDGES 200
+
+void setUp(void) {}
+void tearDown(void) {}
+
+//This moves the simulated clock forward in small steps until the backend has an edge, and returns its time.
+uint32_t next_edge(SimulatedPeriodBackend * simulation, PeriodBackend * backend)
+{
+	uint32_t edge_time;
+	while(!backend->read_edge(&edge_time)){
+		simulation->advance(PB_SIM_CYCLES_PER_SECOND/100000);
+	}
+	return edge_time;
+}
+
+//With no jitter, every period should be exactly the model period, and no edge should come before the clock reaches it.
+void test_edges_match_model_period(void)
+{
+	SimulatedPeriodBackend simulation(PB_SIM_DEFAULT_LOWEST_FREQ, PB_SIM_DEFAULT_HIGHEST_FREQ, 0);
+	PeriodBackend * backend = &simulation;
+	backend->begin();
+	uint32_t expected = simulation.model_period(0);
+
+	uint32_t edge_time;
+	TEST_ASSERT_FALSE(backend->read_edge(&edge_time));
+
+	uint32_t last_edge = next_edge(&simulation, backend);
+	for(int i=0; i<TEST_NUM_EDGES; i++){
+		uint32_t edge = next_edge(&simulation, backend);
+		TEST_ASSERT_EQUAL_UINT32(expected, edge - last_edge);
+		TEST_ASSERT_TRUE((int32_t)(backend->current_time() - edge) >= 0);
+		last_edge = edge;
+	}
+}
+
+//After a resistance change the period should move towards the new one without overshooting, and end up on it.
+void test_resistance_change_settles(void)
+{
+	SimulatedPeriodBackend simulation(PB_SIM_DEFAULT_LOWEST_FREQ, PB_SIM_DEFAULT_HIGHEST_FREQ, 0);
+	PeriodBackend * backend = &simulation;
+	backend->begin();
+	uint32_t start_period = simulation.model_period(0);
+	uint32_t target_period = simulation.model_period(PB_SIM_MAX_RESISTANCE/2);
+
+	uint32_t last_edge = next_edge(&simulation, backend);
+	backend->resistance_changed(PB_SIM_MAX_RESISTANCE/2);
+	uint32_t last_period = start_period;
+	for(int i=0; i<TEST_NUM_EDGES; i++){
+		uint32_t edge = next_edge(&simulation, backend);
+		uint32_t period = edge - last_edge;
+		TEST_ASSERT_TRUE(period <= last_period);
+		TEST_ASSERT_TRUE(period >= target_period);
+		last_period = period;
+		last_edge = edge;
+	}
+	TEST_ASSERT_EQUAL_UINT32(target_period, last_period);
+}
+
+//With jitter, every period should stay within the jitter of the model period, and the same settings should give the same edges.
+void test_jitter_is_bounded_and_repeatable(void)
+{
+	const uint32_t jitter = PB_SIM_DEFAULT_JITTER_CYCLES;
+	SimulatedPeriodBackend first(PB_SIM_DEFAULT_LOWEST_FREQ, PB_SIM_DEFAULT_HIGHEST_FREQ, jitter);
+	SimulatedPeriodBackend second(PB_SIM_DEFAULT_LOWEST_FREQ, PB_SIM_DEFAULT_HIGHEST_FREQ, jitter);
+	PeriodBackend * first_backend = &first;
+	PeriodBackend * second_backend = &second;
+	first_backend->begin();
+	second_backend->begin();
+	uint32_t expected = first.model_period(0);
+
+	uint32_t last_edge = next_edge(&first, first_backend);
+	TEST_ASSERT_EQUAL_UINT32(last_edge, next_edge(&second, second_backend));
+	for(int i=0; i<TEST_NUM_EDGES; i++){
+		uint32_t edge = next_edge(&first, first_backend);
+		TEST_ASSERT_UINT32_WITHIN(jitter, expected, edge - last_edge);
+		TEST_ASSERT_EQUAL_UINT32(edge, next_edge(&second, second_backend));
+		last_edge = edge;
+	}
+}
+
+int main(int argc, char ** argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_edges_match_model_period);
+	RUN_TEST(test_resistance_change_settles);
+	RUN_TEST(test_jitter_is_bounded_and_repeatable);
+	return UNITY_END();
+}